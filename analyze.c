@@ -0,0 +1,353 @@
+/* Cascade (C) 1997 Richard W.M. Jones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cascade.h"
+
+/* Analyse a stream of positions, read from a file or stdin, giving the
+ * value of every letter which can still be picked, found by the same
+ * search the machine uses to move. Each position starts with a line
+ *
+ *	position WIDTH HEIGHT PSCORE MSCORE NEGATE DOUBLE SIDE PICKED
+ *
+ * where SIDE is 0 if the player is to move, 1 if the machine is, and
+ * PICKED lists the letters picked already, or is "-". HEIGHT lines of
+ * WIDTH cells follow, drawn as on the screen: '.' or ' ' for empty,
+ * '|' wall, '#' brick, 'o' ball, '-' negate, '*' double, '$' heart, or
+ * the letter itself. A line starting with "rawposition" instead is
+ * followed by WIDTH*HEIGHT bytes of board, as held in memory (eg. as
+ * sent in a broadcast keyframe). Either way the first and last cell of
+ * every row must be a wall. Blank lines and lines starting with ';'
+ * may come between positions.
+ *
+ * For each position one line is written, in the order read:
+ *
+ *	N DEPTH L=VALUE L=VALUE ...
+ *
+ * where N counts the positions from 0, and each VALUE is the search's
+ * evaluation for the side to move after DEPTH moves. That is its lead,
+ * plus a bonus if it leaves the negate flag set (more if the double
+ * flag is set too), as those hurt the other side on its next move.
+ * The depth given with -d must be odd, since the machine only
+ * searches to odd depths, so that every line ends with a move of the
+ * side to move.
+ *
+ * The positions are shared out to worker threads through a ring of
+ * slots, so no more than a few per thread are held at once however
+ * long the stream is, and each is written out as soon as those before
+ * it are done.
+ */
+
+volatile int quit = 0;
+
+struct slot {
+  state *s;			/* Position, or NULL if the slot is free. */
+  int done;			/* Set when it has been searched. */
+  struct search_params params;
+};
+
+static const char *input_name;
+static long line_number = 0;
+static int ply = 3;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static struct slot *slots;
+static int nr_slots;
+static long next_in = 0;	/* Positions read. */
+static long next_work = 0;	/* Positions taken by the workers. */
+static long next_out = 0;	/* Positions written out. */
+static int end_of_input = 0;
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: cascade-analyze [-d depth] [-j threads] [file]\n"
+	   "where depth is odd, as the machine searches (default 3)\n");
+  exit (1);
+}
+
+static void print_finished (long keep);
+
+/* Stop at bad input, after writing out the positions before it. */
+static void
+bad_input (const char *msg)
+{
+  print_finished (0);
+  fprintf (stderr, "%s:%ld: %s\n", input_name, line_number, msg);
+  exit (1);
+}
+
+static int
+is_letter (int c)
+{
+  return c != 0 && memchr (letters, c, BD_NR_LETTERS) != NULL;
+}
+
+static int
+cell_of_char (int c)
+{
+  switch (c)
+    {
+    case '.': case ' ': return BD_EMPTY;
+    case '|': return BD_WALL;
+    case '#': return BD_BRICK;
+    case 'o': return BD_BALL;
+    case '-': return BD_NEGATE;
+    case '*': return BD_DOUBLE;
+    case '$': return BD_HEART;
+    }
+  if (!is_letter (c))
+    bad_input ("bad cell in board");
+  return c;
+}
+
+/* The balls are kept on the board only by the walls down each side. */
+static void
+check_walls (const state *s, int y)
+{
+  const char *row = s->board + (long) y * s->geom.width;
+
+  if (row [0] != BD_WALL || row [s->geom.width-1] != BD_WALL)
+    bad_input ("board without walls down each side");
+}
+
+/* Read a line, without its newline. Returns NULL at the end of input. */
+static char *
+read_line (FILE *fp, char **buf, size_t *size)
+{
+  ssize_t n = getline (buf, size, fp);
+
+  if (n == -1)
+    return NULL;
+  line_number ++;
+  if (n > 0 && (*buf) [n-1] == '\n')
+    (*buf) [n-1] = '\0';
+  return *buf;
+}
+
+/* Read the next position, and the side to move in it. Returns NULL
+ * at the end of input.
+ */
+static state *
+read_position (FILE *fp, int *side)
+{
+  static char *buf = NULL;
+  static size_t size = 0;
+  char kind [16], picked [BD_NR_LETTERS+2];
+  int w, h, x, y, i;
+  long n;
+  char *line;
+  state *s;
+
+  do
+    if ((line = read_line (fp, &buf, &size)) == NULL)
+      return NULL;
+  while (line [strspn (line, " \t")] == '\0' || line [0] == ';');
+
+  s = init_state ();
+  if (sscanf (line, "%15s %d %d %d %d %d %d %d %37s", kind, &w, &h,
+	      &s->pscore, &s->mscore, &s->negate, &s->dooble,
+	      side, picked) != 9 ||
+      (strcmp (kind, "position") != 0 && strcmp (kind, "rawposition") != 0))
+    bad_input ("expected a position");
+  if (w < 3 || h < 1 || w > 65536 || h > 65536 || (long) w * h > 1L << 28)
+    bad_input ("bad board size");
+  if (*side != 0 && *side != 1)
+    bad_input ("side must be 0 or 1");
+  if (strcmp (picked, "-") != 0)
+    for (i = 0; picked [i]; ++i)
+      {
+	if (!is_letter (picked [i]))
+	  bad_input ("bad letter in picked set");
+	s->picked [strchr (letters, picked [i]) - letters] = 1;
+      }
+
+  init_geometry (&s->geom, w, h);
+  s->board = malloc ((long) w * h);
+  if (s->board == NULL)
+    fatal_perror ("malloc");
+  if (kind [0] == 'r')
+    {
+      if (fread (s->board, w, h, fp) != h)
+	bad_input ("board cut short");
+      for (n = 0; n < (long) w * h; ++n)
+	if ((unsigned char) s->board [n] > BD_HEART && !is_letter (s->board [n]))
+	  bad_input ("bad cell in board");
+      for (y = 0; y < h; ++y)
+	check_walls (s, y);
+    }
+  else
+    for (y = 0; y < h; ++y)
+      {
+	if ((line = read_line (fp, &buf, &size)) == NULL)
+	  bad_input ("board cut short");
+	for (x = 0; x < w && line [x]; ++x)
+	  s->board [(long) y * w + x] = cell_of_char (line [x]);
+	for (; x < w; ++x)
+	  s->board [(long) y * w + x] = BD_EMPTY;
+	if (line [x] != '\0')
+	  bad_input ("board line too long");
+	check_walls (s, y);
+      }
+  s->rows_ready = h;
+  s->balls_in_play = count_balls_on_board (&s->geom, s->board);
+  return s;
+}
+
+static void *
+worker (void *arg)
+{
+  pthread_mutex_lock (&lock);
+  for (;;)
+    {
+      struct slot *sl;
+
+      while (next_work == next_in && !end_of_input)
+	pthread_cond_wait (&work_cond, &lock);
+      if (next_work == next_in)
+	break;
+      sl = &slots [next_work++ % nr_slots];
+      pthread_mutex_unlock (&lock);
+
+      search_machine_move (sl->s, &sl->params);
+
+      pthread_mutex_lock (&lock);
+      sl->done = 1;
+      pthread_cond_signal (&done_cond);
+    }
+  pthread_mutex_unlock (&lock);
+  return NULL;
+}
+
+static void
+print_result (long n, struct slot *sl)
+{
+  int i;
+
+  printf ("%ld %d", n, sl->params.depth_reached);
+  for (i = 0; i < BD_NR_LETTERS; ++i)
+    if (!sl->s->picked [i])
+      printf (" %c=%d", letters [i], sl->params.scores [i]);
+  printf ("\n");
+}
+
+/* Write out the positions which are done, in order, waiting until no
+ * more than "keep" are left outstanding.
+ */
+static void
+print_finished (long keep)
+{
+  int printed = 0;
+
+  pthread_mutex_lock (&lock);
+  while (next_out < next_in)
+    {
+      struct slot *sl = &slots [next_out % nr_slots];
+
+      if (!sl->done)
+	{
+	  if (next_in - next_out <= keep)
+	    break;
+	  pthread_cond_wait (&done_cond, &lock);
+	  continue;
+	}
+      pthread_mutex_unlock (&lock);
+
+      print_result (next_out, sl);
+      free_state (sl->s);
+      sl->s = NULL;
+      printed = 1;
+
+      pthread_mutex_lock (&lock);
+      sl->done = 0;
+      next_out ++;
+    }
+  pthread_mutex_unlock (&lock);
+
+  /* Let a reader down a pipe keep up. */
+  if (printed)
+    fflush (stdout);
+}
+
+int
+main (int argc, char *argv [])
+{
+  int c, i, nr_threads = sysconf (_SC_NPROCESSORS_ONLN);
+  pthread_t *threads;
+  FILE *fp = stdin;
+  state *s;
+  int side;
+
+  while ((c = getopt (argc, argv, "d:j:")) != -1)
+    switch (c)
+      {
+      case 'd': ply = atoi (optarg); break;
+      case 'j': nr_threads = atoi (optarg); break;
+      default: usage ();
+      }
+  if (argc - optind > 1 || ply < 1 || ply % 2 == 0 || nr_threads < 1)
+    usage ();
+
+  input_name = "stdin";
+  if (argc - optind == 1 && strcmp (argv [optind], "-") != 0)
+    {
+      input_name = argv [optind];
+      fp = fopen (input_name, "r");
+      if (fp == NULL)
+	{
+	  perror (input_name);
+	  exit (1);
+	}
+    }
+
+  TRACE_ONLY (start_trace ();)
+  nr_slots = 4 * nr_threads;
+  slots = calloc (nr_slots, sizeof (struct slot));
+  threads = malloc (nr_threads * sizeof (pthread_t));
+  if (slots == NULL || threads == NULL)
+    fatal_perror ("malloc");
+  for (i = 0; i < nr_threads; ++i)
+    if (pthread_create (&threads [i], NULL, worker, NULL) != 0)
+      fatal_perror ("pthread_create");
+
+  while ((s = read_position (fp, &side)) != NULL)
+    {
+      struct slot *sl;
+
+      /* Make room, writing out what is done meanwhile. */
+      print_finished (nr_slots - 1);
+
+      sl = &slots [next_in % nr_slots];
+      init_search_params (&sl->params, 3);
+      sl->params.side = side;
+      sl->params.ply = ply;
+      sl->params.exact = 1;
+      sl->s = s;
+
+      pthread_mutex_lock (&lock);
+      next_in ++;
+      pthread_cond_signal (&work_cond);
+      pthread_mutex_unlock (&lock);
+    }
+
+  pthread_mutex_lock (&lock);
+  end_of_input = 1;
+  pthread_cond_broadcast (&work_cond);
+  pthread_mutex_unlock (&lock);
+  print_finished (0);
+
+  for (i = 0; i < nr_threads; ++i)
+    pthread_join (threads [i], NULL);
+  TRACE_ONLY (stop_trace ();)
+  if (fp != stdin)
+    fclose (fp);
+  free (slots);
+  free (threads);
+  exit (0);
+}
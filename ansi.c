@@ -0,0 +1,160 @@
+/* Cascade (C) 1997 Richard W.M. Jones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "cascade.h"
+
+/* Draw on an ANSI terminal without going through curses (see
+ * screen.c, which still uses curses for the keyboard). The screen is
+ * kept as two arrays of cells (see CELL_* in cascade.h): "back", which
+ * is drawn on, and "front", which is what the terminal is showing.
+ * flush_ansi sends the escape sequences for just the cells which
+ * differ, built up in one buffer and sent with one write.
+ */
+
+#define UNKNOWN_CELL (-1)	/* Not known to be on the terminal. */
+#define MAX_CELL_BYTES 32	/* Most bytes sent for any one cell. */
+#define MAX_GAP 4		/* Resend up to this many unchanged cells
+				 * rather than moving the cursor. */
+
+static int out_fd = -1;
+static int ansi_width, ansi_height;
+static int *front = NULL, *back = NULL;
+static char *out = NULL;
+
+/* SGR colour for each colour pair, as set up in screen.c. */
+static const char pair_colors [] = { 0, '2', '6', '1', '3' };
+
+void
+init_ansi (int fd, int width, int height)
+{
+  int c;
+
+  free_ansi ();
+  out_fd = fd;
+  ansi_width = width;
+  ansi_height = height;
+  front = malloc (width * height * sizeof (int));
+  back = malloc (width * height * sizeof (int));
+  out = malloc (width * height * MAX_CELL_BYTES + 64);
+  if (front == NULL || back == NULL || out == NULL)
+    fatal_perror ("malloc");
+  for (c = 0; c < width * height; ++c)
+    {
+      front [c] = UNKNOWN_CELL;
+      back [c] = ' ';
+    }
+}
+
+void
+free_ansi (void)
+{
+  free (front);
+  free (back);
+  free (out);
+  front = back = NULL;
+  out = NULL;
+}
+
+void
+put_ansi_cell (int y, int x, int cell)
+{
+  if (0 <= x && x < ansi_width && 0 <= y && y < ansi_height)
+    back [x + y * ansi_width] = cell;
+}
+
+/* Blank the whole screen. */
+void
+clear_ansi (void)
+{
+  int c;
+
+  for (c = 0; c < ansi_width * ansi_height; ++c)
+    back [c] = ' ';
+}
+
+/* Send every cell again at the next flush, eg. after ^L. */
+void
+redraw_ansi (void)
+{
+  int c;
+
+  for (c = 0; c < ansi_width * ansi_height; ++c)
+    front [c] = UNKNOWN_CELL;
+}
+
+/* Append one cell to "p", changing the attributes first if need be. */
+static inline char *
+emit_cell (char *p, int cell, int *attrs)
+{
+  int a = cell & ~0xff;
+
+  if (a != *attrs)
+    {
+      *p++ = '\033'; *p++ = '['; *p++ = '0';
+      if (a & CELL_BOLD)
+	{ *p++ = ';'; *p++ = '1'; }
+      if (a & CELL_REVERSE)
+	{ *p++ = ';'; *p++ = '7'; }
+      if (CELL_PAIR (a))
+	p += sprintf (p, ";3%c;40", pair_colors [CELL_PAIR (a)]);
+      *p++ = 'm';
+      *attrs = a;
+    }
+  *p++ = cell & 0xff;
+  return p;
+}
+
+/* Send the cells which have changed since the last flush. */
+void
+flush_ansi (void)
+{
+  char *p = out;
+  int x, y, attrs = -1;		/* Attributes on the terminal now. */
+  size_t n;
+
+  for (y = 0; y < ansi_height; ++y)
+    {
+      int *f = front + y * ansi_width, *b = back + y * ansi_width;
+      int cx = -1;		/* Cursor column, if on this row. */
+
+      for (x = 0; x < ansi_width; ++x)
+	{
+	  if (f [x] == b [x])
+	    continue;
+
+	  if (cx >= 0 && x - cx <= MAX_GAP)
+	    for (; cx < x; ++cx)
+	      p = emit_cell (p, b [cx], &attrs);
+	  else if (cx != x)
+	    p += sprintf (p, "\033[%d;%dH", y+1, x+1);
+
+	  p = emit_cell (p, b [x], &attrs);
+	  f [x] = b [x];
+	  cx = x+1;
+	}
+    }
+  if (attrs > 0)
+    p += sprintf (p, "\033[0m");
+
+  /* One write, unless it is interrupted or the terminal is slow. */
+  n = p - out;
+  p = out;
+  while (n > 0)
+    {
+      ssize_t r = write (out_fd, p, n);
+
+      if (r == -1)
+	{
+	  if (errno == EINTR || errno == EAGAIN)
+	    continue;
+	  return;
+	}
+      p += r;
+      n -= r;
+    }
+}
@@ -0,0 +1,308 @@
+/* Cascade (C) 1997 Richard W.M. Jones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "cascade.h"
+
+/* Boards too big for memory, kept on disk in a file of bands of rows,
+ * each band starting on a page so that it can be mapped by itself.
+ * Only a few bands are mapped at once, the least recently used being
+ * unmapped to make room for another, so a game on a board of any size
+ * runs in a fixed amount of memory.
+ *
+ * A move is one pass over the bands, from the bottom up, since that is
+ * the order drop_balls lets the balls fall in (and the scores depend on
+ * the order). The letter is removed from each band just before its
+ * balls fall: they fall only into the bands below, which have been
+ * done already. Mostly a ball comes to rest in its own band or the
+ * next, which are still mapped, so the file is read and written in
+ * order, a band at a time. Late in a game balls fall further, and each
+ * row a ball falls through outside the mapped bands costs a page
+ * fault: more bands resident means fewer of them.
+ *
+ * As on a board in memory, rows are only made as the balls reach them
+ * (see ensure_board_rows), and the rest of the file is left as a hole.
+ */
+
+#define MIN_RESIDENT 2		/* A falling ball needs its row and the next. */
+
+struct band {
+  int nr;			/* Band mapped here, or -1. */
+  char *rows;
+  unsigned long used;		/* When it was last used, for LRU. */
+};
+
+struct band_board {
+  state *s;			/* Scores, flags, picked letters, etc. */
+  int fd;
+  char *path;
+  int band_rows;		/* Rows in each band. */
+  size_t stride;		/* Bytes from one band to the next. */
+  int nr_resident;
+  struct band *resident;
+  struct band *last;		/* Band used last. */
+  unsigned long clock;
+};
+
+static void
+unmap_band (struct band *b, size_t stride)
+{
+  if (b->nr >= 0)
+    munmap (b->rows, stride);
+  b->nr = -1;
+}
+
+/* Map band "nr", if it is not mapped already. */
+static struct band *
+get_band (struct band_board *bb, int nr)
+{
+  struct band *b, *victim = NULL;
+  int k;
+
+  if (bb->last->nr == nr)
+    return bb->last;
+
+  for (k = 0; k < bb->nr_resident; ++k)
+    {
+      b = &bb->resident [k];
+      if (b->nr == nr)
+	goto found;
+      if (victim == NULL || b->used < victim->used)
+	victim = b;
+    }
+
+  b = victim;
+  unmap_band (b, bb->stride);
+  b->rows = mmap (NULL, bb->stride, PROT_READ | PROT_WRITE, MAP_SHARED,
+		  bb->fd, (off_t) nr * bb->stride);
+  if (b->rows == MAP_FAILED)
+    fatal_perror (bb->path);
+  b->nr = nr;
+
+ found:
+  b->used = ++bb->clock;
+  bb->last = b;
+  return b;
+}
+
+static inline char *
+band_row (struct band_board *bb, int j)
+{
+  struct band *b = get_band (bb, j / bb->band_rows);
+
+  return b->rows + (long) (j % bb->band_rows) * bb->s->geom.width;
+}
+
+/* As ensure_board_rows, for a board in bands. */
+static void
+ensure_band_rows (struct band_board *bb, int nr_rows)
+{
+  state *s = bb->s;
+  int j;
+
+  if (nr_rows <= s->rows_ready)
+    return;
+  nr_rows += LAZY_ROWS;
+  if (nr_rows > s->geom.height)
+    nr_rows = s->geom.height;
+  for (j = s->rows_ready; j < nr_rows; ++j)
+    generate_board_row (&s->geom, band_row (bb, j), s->seed, s->picked, j);
+  s->rows_ready = nr_rows;
+}
+
+/* Make the file "path" for a new game in "s" on a board of geometry
+ * "g", in bands of "band_rows" rows with at most "nr_resident" mapped
+ * at once. s->board is not used. Returns NULL, with errno set, if the
+ * file cannot be made.
+ */
+struct band_board *
+open_band_board (const char *path, state *s, const struct geometry *g,
+		 unsigned int seed, int band_rows, int nr_resident)
+{
+  struct band_board *bb;
+  long page = sysconf (_SC_PAGESIZE);
+  int nr_bands, k, j;
+
+  assert (band_rows >= 1);
+  if (nr_resident < MIN_RESIDENT)
+    nr_resident = MIN_RESIDENT;
+
+  bb = malloc (sizeof (struct band_board));
+  if (bb == NULL)
+    fatal_perror ("malloc");
+  bb->fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (bb->fd == -1)
+    {
+      free (bb);
+      return NULL;
+    }
+
+  bb->band_rows = band_rows < g->height ? band_rows : g->height;
+  bb->stride = ((size_t) bb->band_rows * g->width + page-1) / page * page;
+  nr_bands = (g->height + bb->band_rows-1) / bb->band_rows;
+  if (ftruncate (bb->fd, (off_t) nr_bands * bb->stride) == -1)
+    {
+      int e = errno;
+
+      close (bb->fd);
+      unlink (path);
+      free (bb);
+      errno = e;
+      return NULL;
+    }
+
+  bb->path = strdup (path);
+  bb->nr_resident = nr_resident;
+  bb->resident = malloc (nr_resident * sizeof (struct band));
+  if (bb->path == NULL || bb->resident == NULL)
+    fatal_perror ("malloc");
+  for (k = 0; k < nr_resident; ++k)
+    {
+      bb->resident [k].nr = -1;
+      bb->resident [k].used = 0;
+    }
+  bb->last = &bb->resident [0];
+  bb->clock = 0;
+
+  memset (s, 0, sizeof (state));
+  s->geom = *g;
+  s->seed = seed;
+  bb->s = s;
+  ensure_band_rows (bb, 1);
+  for (j = 0; j < s->rows_ready; ++j)
+    s->balls_in_play += count_balls_on_rows (g, band_row (bb, j), 1);
+  return bb;
+}
+
+/* Throw the board away, file and all. */
+void
+close_band_board (struct band_board *bb)
+{
+  int k;
+
+  for (k = 0; k < bb->nr_resident; ++k)
+    unmap_band (&bb->resident [k], bb->stride);
+  close (bb->fd);
+  unlink (bb->path);
+  free (bb->path);
+  free (bb->resident);
+  free (bb);
+}
+
+/* Let the ball at (i,j) fall as far as it can, as drop_balls would.
+ * The rows are looked up afresh at each step, since making rows or
+ * reaching the next band can unmap the band they were in.
+ */
+static void
+fall_in_bands (struct band_board *bb, int who_moved, int i, int j)
+{
+  state *s = bb->s;
+  const int H = s->geom.height;
+
+  for (;;)
+    {
+      char *row, *below;
+      int c, di;
+
+      if (j+1 < H && j+1 >= s->rows_ready)
+	ensure_band_rows (bb, j+2);
+
+      row = band_row (bb, j);
+      if (j == H-1)
+	{
+	  row [i] = BD_EMPTY;
+	  STATS_ADD (ball_steps, 1);
+	  TRACE (TRACE_BALL_TO_FLOOR, i, j, 0);
+	  set_score (s, who_moved, 1);
+	  s->balls_in_play --;
+	  return;
+	}
+
+      below = band_row (bb, j+1);
+      if (is_squashy_item (c = below [i]))
+	di = 0;
+      else if (is_squashy_item (c = below [i-1]))
+	di = -1;
+      else if (is_squashy_item (c = below [i+1]))
+	di = 1;
+      else
+	return;
+
+      row [i] = BD_EMPTY;
+      i += di;
+      j ++;
+      below [i] = BD_BALL;
+      STATS_ADD (ball_steps, 1);
+      TRACE (TRACE_BALL_FALLS, i, j, c);
+
+      switch (c)
+	{
+	case BD_NEGATE:
+	  flip_negate (s);
+	  break;
+	case BD_DOUBLE:
+	  flip_double (s);
+	  break;
+	case BD_HEART:
+	  set_score (s, who_moved, 4);
+	  break;
+	}
+    }
+}
+
+/* Remove "letter" from the board and let the balls fall: the same as
+ * remove_letter_from_board and then drop_balls on a board in memory.
+ * The caller marks the letter as picked.
+ */
+void
+play_letter_in_bands (struct band_board *bb, int who_moved, int letter)
+{
+  state *s = bb->s;
+  const int W = s->geom.width;
+  const char l = letter;
+  int top, j, band;
+
+  TRACE_SPAN (TRACE_DROP, who_moved, s->balls_in_play, 0);
+  for (band = (s->rows_ready-1) / bb->band_rows; band >= 0; --band)
+    {
+      top = band * bb->band_rows;
+
+      /* Read the band above while this one is done. */
+      if (band > 0)
+	posix_fadvise (bb->fd, (off_t) (band-1) * bb->stride, bb->stride,
+		       POSIX_FADV_WILLNEED);
+
+      /* Rows made from now on are made without the letter. */
+      for (j = top; j < top + bb->band_rows && j < s->rows_ready; ++j)
+	{
+	  char *row = band_row (bb, j);
+	  int c;
+
+	  for (c = 0; c < W; ++c)
+	    row [c] = row [c] == l ? BD_EMPTY : row [c];
+	}
+
+      for (j--; j >= top; --j)
+	{
+	  char *row = band_row (bb, j), *p = row;
+
+	  while ((p = memchr (p, BD_BALL, W - (p - row))) != NULL)
+	    {
+	      int i = p - row;
+
+	      fall_in_bands (bb, who_moved, i, j);
+	      row = band_row (bb, j);
+	      p = row + i + 1;
+	    }
+	}
+    }
+  TRACE_SPAN (TRACE_DROP_END, s->balls_in_play, 0, 0);
+}
@@ -0,0 +1,421 @@
+/* Cascade (C) 1997 Richard W.M. Jones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "cascade.h"
+
+/* Evaluate every candidate letter in one pass over the board.
+ *
+ * The boards which result from removing each letter are laid out as a
+ * structure of arrays: for each cell, one byte lane per candidate,
+ * LANES lanes in all, so that each cell of all the candidate boards
+ * is contiguous. Removing the letters and looking for balls which can
+ * move are then done for all the candidates at once, with GCC's
+ * vector extensions. Only the lanes in which a ball can really fall
+ * are followed one by one.
+ *
+ * This gives exactly the same results as remove_letter_from_board
+ * followed by drop_balls for each letter. drop_balls lets each ball
+ * fall as far as it can, working up from the bottom row and from
+ * left to right along each row. (After following a ball down it
+ * scans some rows again, but that never moves anything more.)
+ */
+
+/* Each cell is NR_VECTORS vectors of VECTOR bytes. 16 byte vectors
+ * are native on every x86-64 (and most other SIMD units); GCC splits
+ * anything wider into single bytes unless the processor has it.
+ */
+#define VECTOR 16
+#define NR_VECTORS ((BD_NR_LETTERS + VECTOR-1) / VECTOR)
+#define LANES (VECTOR * NR_VECTORS)
+
+typedef unsigned char vec __attribute__ ((vector_size (VECTOR)));
+
+typedef struct {
+  vec v [NR_VECTORS];
+} lanes;
+
+/* Each thread keeps its own workspace, which grows as needed. */
+struct workspace {
+  size_t size;
+  lanes *cells;
+  int row_size;
+  char *row;			/* A row of a lazy board, as it is made. */
+  unsigned char *reach;		/* Two rows for find_dead_letters. */
+};
+
+/* The evaluation now going on. */
+struct batch {
+  const state *state_ptr;
+  struct workspace *w;
+  lanes letter_lanes;		/* Letter removed in each lane. */
+  int rows_ready;		/* Rows of the board copied into the lanes. */
+};
+
+static pthread_key_t workspace_key;
+static pthread_once_t workspace_once = PTHREAD_ONCE_INIT;
+
+static void
+free_workspace (void *vp)
+{
+  struct workspace *w = (struct workspace *) vp;
+
+  free (w->cells);
+  free (w->row);
+  free (w->reach);
+  free (w);
+}
+
+static void
+make_workspace_key (void)
+{
+  pthread_key_create (&workspace_key, free_workspace);
+}
+
+/* The workspace is big enough for the whole board, but only the
+ * rows which are really used are ever touched.
+ */
+static struct workspace *
+get_workspace (const struct geometry *g)
+{
+  size_t nr_cells = (size_t) g->width * g->height;
+  struct workspace *w;
+
+  pthread_once (&workspace_once, make_workspace_key);
+  w = pthread_getspecific (workspace_key);
+  if (w == NULL)
+    {
+      w = malloc (sizeof (struct workspace));
+      if (w == NULL)
+	fatal_perror ("malloc");
+      w->size = 0;
+      w->cells = NULL;
+      w->row_size = 0;
+      w->row = NULL;
+      w->reach = NULL;
+      pthread_setspecific (workspace_key, w);
+    }
+  if (w->size < nr_cells)
+    {
+      free (w->cells);
+      if (posix_memalign ((void **) &w->cells, sizeof (vec),
+			  nr_cells * sizeof (lanes)) != 0)
+	fatal ("cannot allocate the batch workspace");
+      w->size = nr_cells;
+    }
+  if (w->row_size < g->width)
+    {
+      free (w->row);
+      free (w->reach);
+      w->row = malloc (g->width);
+      w->reach = malloc (2 * (g->width + 2));
+      if (w->row == NULL || w->reach == NULL)
+	fatal_perror ("malloc");
+      w->row_size = g->width;
+    }
+  return w;
+}
+
+/* True if any lane of "l" is non-zero. */
+static inline int
+any_lane (const lanes *l)
+{
+  union { vec v; unsigned long long u [VECTOR/8]; } x;
+  int i;
+
+  x.v = l->v [0];
+  for (i = 1; i < NR_VECTORS; ++i)
+    x.v |= l->v [i];
+  for (i = 1; i < VECTOR/8; ++i)
+    x.u [0] |= x.u [i];
+  return x.u [0] != 0;
+}
+
+/* All ones in each lane holding a squashy item (see is_squashy_item). */
+static inline vec
+squashy_lanes (vec v)
+{
+  return (vec) (v == BD_EMPTY) | (vec) ((vec) (v - BD_NEGATE) <= 2);
+}
+
+/* set_score, for one lane. */
+static inline void
+lane_score (struct letter_result *r, int who, int score)
+{
+  if (r->negate) score = -score;
+  if (r->dooble) score *= 2;
+  if (who == 0)
+    r->pscore = r->pscore + score > 0 ? r->pscore + score : 0;
+  else
+    r->mscore = r->mscore + score > 0 ? r->mscore + score : 0;
+}
+
+/* Copy row "y" of a board into every lane, removing that lane's
+ * letter.
+ */
+static inline void
+copy_row (struct batch *b, const char *row, int y, int W)
+{
+  lanes *cells = b->w->cells + y * W;
+  vec zero = { 0 };
+  int i, n;
+
+  for (i = 0; i < W; ++i)
+    {
+      vec v = zero + (unsigned char) row [i];
+
+      for (n = 0; n < NR_VECTORS; ++n)
+	cells [i].v [n] = v & ~(vec) (v == b->letter_lanes.v [n]);
+    }
+}
+
+/* Make sure that the first "nr_rows" rows are in the lanes, making
+ * any rows of a big board which have not been made yet (as
+ * ensure_board_rows would).
+ */
+static void
+ensure_lane_rows (struct batch *b, int nr_rows)
+{
+  const state *s = b->state_ptr;
+
+  if (nr_rows <= b->rows_ready)
+    return;
+  nr_rows += LAZY_ROWS;
+  if (nr_rows > s->geom.height)
+    nr_rows = s->geom.height;
+  for (; b->rows_ready < nr_rows; b->rows_ready ++)
+    {
+      generate_board_row (&s->geom, b->w->row, s->seed, s->picked,
+			  b->rows_ready);
+      copy_row (b, b->w->row, b->rows_ready, s->geom.width);
+    }
+}
+
+/* Like the kernels in board.c, the rest is compiled once for each of
+ * the common board sizes W x H and once for any size.
+ */
+#define KERNEL static inline __attribute__ ((always_inline))
+
+/* Let the ball at (i,j) fall as far as it can in lane "k". */
+KERNEL void
+lane_fall (struct batch *b, int k, int i, int j,
+	   struct letter_result *r, int who, int W, int H)
+{
+  unsigned char *cells = (unsigned char *) b->w->cells;
+#define CELL(x,y) cells [((x) + (y) * W) * LANES + k]
+
+  for (;;)
+    {
+      int c, di;
+
+      if (j+1 < H && j+1 >= b->rows_ready)
+	ensure_lane_rows (b, j+2);
+
+      if (j == H-1)
+	{
+	  CELL (i, j) = BD_EMPTY;
+	  STATS_ADD (ball_steps, 1);
+	  lane_score (r, who, 1);
+	  r->balls_in_play --;
+	  return;
+	}
+
+      if (is_squashy_item (c = CELL (i, j+1)))
+	di = 0;
+      else if (is_squashy_item (c = CELL (i-1, j+1)))
+	di = -1;
+      else if (is_squashy_item (c = CELL (i+1, j+1)))
+	di = 1;
+      else
+	return;
+
+      CELL (i, j) = BD_EMPTY;
+      i += di;
+      j ++;
+      CELL (i, j) = BD_BALL;
+      STATS_ADD (ball_steps, 1);
+
+      switch (c)
+	{
+	case BD_NEGATE:
+	  r->negate = !r->negate;
+	  break;
+	case BD_DOUBLE:
+	  r->dooble = !r->dooble;
+	  break;
+	case BD_HEART:
+	  lane_score (r, who, 4);
+	  break;
+	}
+    }
+#undef CELL
+}
+
+KERNEL void
+play_all_letters_kernel (const state *state_ptr, int who,
+			 struct letter_result *results, int W, int H)
+{
+  struct batch b;
+  lanes active, *cells;
+  vec zero = { 0 }, ball = zero + BD_BALL;
+  int i, j, k, c, n;
+
+  b.state_ptr = state_ptr;
+  b.w = get_workspace (&state_ptr->geom);
+  b.rows_ready = state_ptr->rows_ready;
+  cells = b.w->cells;
+
+  memset (&b.letter_lanes, 0xff, sizeof b.letter_lanes);
+  memset (&active, 0, sizeof active);
+  for (k = 0; k < BD_NR_LETTERS; ++k)
+    {
+      if (!state_ptr->picked [k])
+	{
+	  b.letter_lanes.v [k / VECTOR] [k % VECTOR] = letters [k];
+	  active.v [k / VECTOR] [k % VECTOR] = 0xff;
+	  results [k].pscore = state_ptr->pscore;
+	  results [k].mscore = state_ptr->mscore;
+	  results [k].negate = state_ptr->negate;
+	  results [k].dooble = state_ptr->dooble;
+	  results [k].balls_in_play = state_ptr->balls_in_play;
+	}
+    }
+
+  /* Copy the board into every lane, removing that lane's letter. */
+  for (j = 0; j < b.rows_ready; ++j)
+    copy_row (&b, state_ptr->board + j * W, j, W);
+
+  /* Let the balls fall. There are none in rows not made yet. */
+  for (j = state_ptr->rows_ready-1; j >= 0; --j)
+    for (i = 0, c = j * W; i < W; ++i, ++c)
+      {
+	lanes moving;
+
+	for (n = 0; n < NR_VECTORS; ++n)
+	  moving.v [n] = (vec) (cells [c].v [n] == ball) & active.v [n];
+	if (!any_lane (&moving))
+	  continue;
+	if (j < H-1)
+	  {
+	    ensure_lane_rows (&b, j+2);
+	    for (n = 0; n < NR_VECTORS; ++n)
+	      moving.v [n] &= squashy_lanes (cells [c+W].v [n])
+		| squashy_lanes (cells [c+W-1].v [n])
+		| squashy_lanes (cells [c+W+1].v [n]);
+	    if (!any_lane (&moving))
+	      continue;
+	  }
+
+	for (k = 0; k < BD_NR_LETTERS; ++k)
+	  if (moving.v [k / VECTOR] [k % VECTOR])
+	    lane_fall (&b, k, i, j, &results [k], who, W, H);
+      }
+}
+
+#define BATCH_KERNELS(name, W, H)					\
+static void								\
+play_all_letters_##name (const state *state_ptr, int who,		\
+			 struct letter_result *results)			\
+{									\
+  play_all_letters_kernel (state_ptr, who, results, W, H);		\
+}
+
+BATCH_KERNELS (40x20, 40, 20)
+BATCH_KERNELS (60x19, 60, 19)
+BATCH_KERNELS (any, state_ptr->geom.width, state_ptr->geom.height)
+
+struct batch_kernels {
+  int width, height;		/* Board size, or 0 for any size. */
+  void (*play_all_letters) (const state *, int, struct letter_result *);
+};
+
+static const struct batch_kernels batch_kernels [] = {
+  { 40, 20, play_all_letters_40x20 },
+  { 60, 19, play_all_letters_60x19 },
+  { 0, 0, play_all_letters_any },
+};
+#define NR_BATCH_KERNELS (sizeof batch_kernels / sizeof batch_kernels [0])
+
+/* Called by init_geometry. */
+const struct batch_kernels *
+find_batch_kernels (int width, int height)
+{
+  int i;
+
+  for (i = 0; i < NR_BATCH_KERNELS-1; ++i)
+    if (batch_kernels [i].width == width &&
+	batch_kernels [i].height == height)
+      break;
+  return &batch_kernels [i];
+}
+
+/* For every letter not yet picked in "state_ptr", work out the state
+ * after "who" removes it and the balls fall, without changing
+ * "state_ptr". Entries for letters already picked are left alone.
+ */
+void
+play_all_letters (const state *state_ptr, int who,
+		  struct letter_result *results)
+{
+  state_ptr->geom.batch->play_all_letters (state_ptr, who, results);
+}
+
+/* Find the letters not yet picked which no ball can ever reach, either
+ * because they are not on the board at all or because every one of
+ * them is shut off from the balls by bricks and walls. Playing any of
+ * them changes nothing, now or later, so they are all equivalent.
+ * Sets "dead" for each and returns how many there are.
+ *
+ * A ball can only ever move into cells which are below it and not
+ * brick or wall, so the cells it might reach are found by working
+ * down the board a row at a time from the balls.
+ */
+int
+find_dead_letters (const state *state_ptr, int *dead)
+{
+  const struct geometry *g = &state_ptr->geom;
+  struct workspace *w = get_workspace (g);
+  unsigned char *prev = w->reach + 1, *cur = prev + g->width + 2, *t;
+  unsigned char seen [256], any = 0;
+  int i, j, k, n = 0;
+
+  memset (seen, 0, sizeof seen);
+  memset (w->reach, 0, 2 * (g->width + 2));
+  for (j = 0; j < state_ptr->rows_ready; ++j)
+    {
+      const char *row = state_ptr->board + j * g->width;
+
+      any = 0;
+      for (i = 0; i < g->width; ++i)
+	{
+	  unsigned char c = row [i];
+
+	  cur [i] = c != BD_WALL && c != BD_BRICK &&
+	    (c == BD_BALL || (prev [i-1] | prev [i] | prev [i+1]));
+	  seen [c] |= cur [i];
+	  any |= cur [i];
+	}
+      t = prev; prev = cur; cur = t;
+    }
+
+  /* If the balls might reach the rows not made yet, any letter might
+   * be down there.
+   */
+  if (any && state_ptr->rows_ready < g->height)
+    {
+      memset (dead, 0, BD_NR_LETTERS * sizeof (int));
+      return 0;
+    }
+
+  for (k = 0; k < BD_NR_LETTERS; ++k)
+    {
+      dead [k] = !state_ptr->picked [k] && !seen [(unsigned char) letters [k]];
+      n += dead [k];
+    }
+  return n;
+}
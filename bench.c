@@ -0,0 +1,431 @@
+/* Cascade (C) 1997 Richard W.M. Jones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#ifdef HAVE_NCURSES
+#include <ncurses.h>
+#else
+#include <curses.h>
+#endif
+
+#include "cascade.h"
+
+/* Microbenchmarks for the hot kernels of the game, over a matrix of
+ * terminal sizes and fixed seeds. Each result is one line of CSV (or
+ * one JSON object with -j) giving nanoseconds per operation, board
+ * cells processed per second and allocations per operation. Compare
+ * runs on the same machine only.
+ *
+ * Allocations are counted by wrapping malloc, calloc and realloc at
+ * link time (see the Makefile), so only calls made by the game's own
+ * code are counted, not those inside the curses library.
+ */
+
+volatile int quit = 0;
+
+static long nr_allocations = 0;
+
+extern void *__real_malloc (size_t);
+extern void *__real_calloc (size_t, size_t);
+extern void *__real_realloc (void *, size_t);
+
+void *
+__wrap_malloc (size_t n)
+{
+  nr_allocations ++;
+  return __real_malloc (n);
+}
+
+void *
+__wrap_calloc (size_t n, size_t m)
+{
+  nr_allocations ++;
+  return __real_calloc (n, m);
+}
+
+void *
+__wrap_realloc (void *p, size_t n)
+{
+  nr_allocations ++;
+  return __real_realloc (p, n);
+}
+
+/* Terminal sizes to try. The board is 20 columns narrower and 5 rows
+ * shorter than the terminal (see layout_screen).
+ */
+static const int default_sizes [][2] = {
+  { 60, 25 }, { 80, 24 }, { 132, 43 }, { 250, 100 }, { 1000, 1000 }
+};
+#define NR_DEFAULT_SIZES (sizeof default_sizes / sizeof default_sizes [0])
+
+static const unsigned int default_seeds [] = { 1, 2, 3 };
+#define NR_DEFAULT_SEEDS (sizeof default_seeds / sizeof default_seeds [0])
+
+/* Number of letters picked to make a late-game board. */
+#define LATE_GAME_MOVES 24
+
+/* Games in the env/step benchmark, fewer on big boards. */
+#define ENV_MAX_GAMES 256
+#define ENV_MAX_CELLS (1 << 22)
+
+static double min_time = 0.1;	/* Seconds to run each benchmark for. */
+static const char *only = NULL;	/* Run only benchmarks matching this. */
+static int json = 0;		/* Print JSON instead of CSV. */
+static int first_result = 1;
+
+/* The fixture for the benchmark now running. */
+static struct geometry geometry;
+static unsigned int seed;
+static state *fresh;		/* A new game. */
+static state *late;		/* A game with LATE_GAME_MOVES letters gone. */
+static state *template;		/* Position to reset to before each op. */
+static state *work;		/* Position each op works on. */
+static int level;		/* Difficulty level for search. */
+static struct search_tree *tree; /* Search tree kept, or NULL. */
+static struct env *env;		/* Games stepped together. */
+static int env_games;
+static int env_moves [ENV_MAX_GAMES];
+static int env_rewards [ENV_MAX_GAMES];
+static char env_done [ENV_MAX_GAMES];
+static char env_legal [ENV_MAX_GAMES * BD_NR_LETTERS];
+static struct env_obs env_obs [ENV_MAX_GAMES];
+
+static void
+reset_work (void)
+{
+  char *board = work->board;
+
+  memcpy (work, template, sizeof (state));
+  work->board = board;
+  memcpy (board, template->board, geometry.width * geometry.height);
+}
+
+static void
+op_init_board (void)
+{
+  free_board (init_board_seeded (&geometry, seed));
+}
+
+static void
+op_copy_board (void)
+{
+  free_board (copy_board (&geometry, fresh->board));
+}
+
+static void
+op_count_balls (void)
+{
+  count_balls_on_board (&geometry, fresh->board);
+}
+
+static void
+op_remove_letter (void)
+{
+  remove_letter_from_board (&geometry, work->board,
+			    letters [seed % BD_NR_LETTERS]);
+}
+
+static void
+op_drop_balls (void)
+{
+  drop_balls (work->board, work, 1, 0);
+}
+
+static void
+op_search (void)
+{
+  struct search_params params;
+
+  init_search_params (&params, level);
+  params.tree = tree;
+  if (params.budget > 0)
+    params.deadline = current_time () + params.budget;
+  search_machine_move (template, &params);
+}
+
+/* Play a spread of letters, legal or not, in all the games at once. */
+static void
+op_env_step (void)
+{
+  int g;
+
+  for (g = 0; g < env_games; ++g)
+    env_moves [g] = (env_moves [g] + 7) % BD_NR_LETTERS;
+  step_env (env, env_moves, env_rewards, env_done, env_legal, env_obs, NULL);
+}
+
+static void
+op_update_screen (void)
+{
+  update_screen (fresh);
+}
+
+/* Draw the fresh and late boards in turn, so every cell that differs
+ * between them has to be sent.
+ */
+static void
+op_update_screen_changes (void)
+{
+  static int n = 0;
+
+  update_screen (n++ & 1 ? late : fresh);
+}
+
+/* Run "op" repeatedly for at least min_time seconds, calling "reset"
+ * (untimed) before each call if it is not NULL, and print the result.
+ */
+static void
+bench (const char *name, void (*reset) (void), void (*op) (void))
+{
+  long iterations = 0, allocations = 0, before;
+  double elapsed = 0, t;
+  double cells = (double) geometry.width * geometry.height;
+
+  if (only != NULL && strstr (name, only) == NULL)
+    return;
+
+  /* Warm up. */
+  if (reset) reset ();
+  op ();
+
+  while (elapsed < min_time)
+    {
+      if (reset)
+	{
+	  reset ();
+	  before = nr_allocations;
+	  t = current_time ();
+	  op ();
+	  elapsed += current_time () - t;
+	  allocations += nr_allocations - before;
+	  iterations ++;
+	}
+      else
+	{
+	  long i, n = iterations > 0 ? iterations : 1;
+
+	  before = nr_allocations;
+	  t = current_time ();
+	  for (i = 0; i < n; ++i)
+	    op ();
+	  elapsed += current_time () - t;
+	  allocations += nr_allocations - before;
+	  iterations += n;
+	}
+    }
+
+  if (json)
+    printf ("%s{\"kernel\": \"%s\", \"width\": %d, \"height\": %d, "
+	    "\"seed\": %u, \"iterations\": %ld, \"ns_per_op\": %.1f, "
+	    "\"cells_per_sec\": %.4g, \"allocs_per_op\": %.2f}",
+	    first_result ? "[\n  " : ",\n  ",
+	    name, geometry.width, geometry.height, seed, iterations,
+	    elapsed * 1e9 / iterations, cells * iterations / elapsed,
+	    (double) allocations / iterations);
+  else
+    {
+      if (first_result)
+	printf ("kernel,width,height,seed,iterations,"
+		"ns_per_op,cells_per_sec,allocs_per_op\n");
+      printf ("%s,%d,%d,%u,%ld,%.1f,%.4g,%.2f\n",
+	      name, geometry.width, geometry.height, seed, iterations,
+	      elapsed * 1e9 / iterations, cells * iterations / elapsed,
+	      (double) allocations / iterations);
+    }
+  first_result = 0;
+  fflush (stdout);
+}
+
+/* Play the first letters in order, alternating sides, to get a
+ * late-game position.
+ */
+static state *
+make_late_game (const state *s)
+{
+  state *l = copy_state (s);
+  int i;
+
+  for (i = 0; i < LATE_GAME_MOVES && !game_over (l); ++i)
+    {
+      l->picked [i] = 1;
+      remove_letter_from_board (&l->geom, l->board, letters [i]);
+      drop_balls (l->board, l, i & 1, 0);
+    }
+  return l;
+}
+
+/* Like make_late_game, but only remove the next letter. */
+static state *
+make_removed (const state *s)
+{
+  state *r = copy_state (s);
+  int i;
+
+  for (i = 0; r->picked [i]; ++i)
+    ;
+  r->picked [i] = 1;
+  remove_letter_from_board (&r->geom, r->board, letters [i]);
+  return r;
+}
+
+static FILE *null_out;
+
+/* Use a curses screen which writes to /dev/null. */
+static void
+init_null_screen (int w, int h)
+{
+  static SCREEN *screen = NULL;
+  static FILE *in;
+  const char *term = getenv ("TERM");
+
+  if (screen == NULL)
+    {
+      null_out = fopen ("/dev/null", "w");
+      in = fopen ("/dev/null", "r");
+      if (null_out == NULL || in == NULL)
+	fatal_perror ("/dev/null");
+      screen = newterm ((char *) (term ? term : "vt100"), null_out, in);
+      if (screen == NULL)
+	fatal ("cannot open a null terminal");
+      set_term (screen);
+    }
+  resizeterm (h, w);
+  width = w;
+  height = h;
+  layout_screen ();
+  init_geometry (&geometry, board_width, board_height);
+}
+
+static void
+bench_size (int w, int h)
+{
+  char name [32];
+  state *removed_fresh, *removed_late;
+
+  init_null_screen (w, h);
+
+  fresh = init_state ();
+  generate_board_for_state_seeded (fresh, &geometry, seed);
+  late = make_late_game (fresh);
+  removed_fresh = make_removed (fresh);
+  removed_late = make_removed (late);
+  work = copy_state (fresh);
+
+  bench ("init_board", NULL, op_init_board);
+  bench ("copy_board", NULL, op_copy_board);
+  bench ("count_balls_on_board", NULL, op_count_balls);
+
+  template = fresh;
+  bench ("remove_letter_from_board", reset_work, op_remove_letter);
+
+  template = removed_fresh;
+  bench ("drop_balls/fresh", reset_work, op_drop_balls);
+  template = removed_late;
+  bench ("drop_balls/late", reset_work, op_drop_balls);
+
+  template = fresh;
+  for (level = 1; level <= 5; ++level)
+    {
+      sprintf (name, "search/%d", level);
+      bench (name, NULL, op_search);
+    }
+  tree = init_search_tree ();
+  for (level = 4; level <= 5; ++level)
+    {
+      sprintf (name, "search/%d/tree", level);
+      bench (name, NULL, op_search);
+    }
+  free_search_tree (tree);
+  tree = NULL;
+
+  bench ("update_screen", NULL, op_update_screen);
+  bench ("update_screen/changes", NULL, op_update_screen_changes);
+  start_ansi_screen (fileno (null_out));
+  bench ("update_screen/ansi", NULL, op_update_screen);
+  bench ("update_screen/ansi/changes", NULL, op_update_screen_changes);
+  stop_ansi_screen ();
+
+  env_games = ENV_MAX_CELLS / (geometry.width * geometry.height);
+  if (env_games > ENV_MAX_GAMES)
+    env_games = ENV_MAX_GAMES;
+  if (env_games < 1)
+    env_games = 1;
+  for (level = 0; level <= 3; level += 3)
+    {
+      int g;
+
+      env = init_env (env_games, geometry.width, geometry.height,
+		      seed, level);
+      for (g = 0; g < env_games; ++g)
+	env_moves [g] = g;
+      sprintf (name, level ? "env/step/%d" : "env/step", level);
+      bench (name, NULL, op_env_step);
+      free_env (env);
+    }
+
+  free_state (work);
+  free_state (removed_late);
+  free_state (removed_fresh);
+  free_state (late);
+  free_state (fresh);
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+	   "usage: cascade-bench [-j] [-t secs] [-k kernel] [-s seed]\n"
+	   "                     [-z WIDTHxHEIGHT]\n"
+	   "sizes are terminal sizes; the default is every size in the\n"
+	   "matrix from 60x25 to 1000x1000, for seeds 1, 2 and 3\n");
+  exit (1);
+}
+
+int
+main (int argc, char *argv [])
+{
+  int c, i, j, w = 0, h = 0;
+  unsigned int one_seed = 0;
+
+  while ((c = getopt (argc, argv, "jt:k:s:z:")) != -1)
+    switch (c)
+      {
+      case 'j': json = 1; break;
+      case 't': min_time = atof (optarg); break;
+      case 'k': only = optarg; break;
+      case 's': one_seed = strtoul (optarg, NULL, 0); break;
+      case 'z':
+	if (sscanf (optarg, "%dx%d", &w, &h) != 2 || w < 60 || h < 24)
+	  usage ();
+	break;
+      default: usage ();
+      }
+  if (optind != argc)
+    usage ();
+
+  for (i = 0; i < NR_DEFAULT_SIZES; ++i)
+    {
+      if (w > 0 && i > 0)
+	break;
+      for (j = 0; j < NR_DEFAULT_SEEDS; ++j)
+	{
+	  if (one_seed > 0 && j > 0)
+	    break;
+	  seed = one_seed > 0 ? one_seed : default_seeds [j];
+	  if (w > 0)
+	    bench_size (w, h);
+	  else
+	    bench_size (default_sizes [i][0], default_sizes [i][1]);
+	}
+    }
+
+  if (json && !first_result)
+    printf ("\n]\n");
+
+  endwin ();
+  exit (0);
+}
@@ -13,195 +13,283 @@
 char letters [BD_NR_LETTERS] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
 
 inline char
-bd_get (const char *board, int x, int y)
+bd_get (const struct geometry *g, const char *board, int x, int y)
 {
   assert (board != NULL);
-  assert (0 <= x && x < board_width);
-  assert (0 <= y && y < board_height);
+  assert (0 <= x && x < g->width);
+  assert (0 <= y && y < g->height);
 
-  return board [x + y * board_width];
+  return board [x + y * g->width];
 }
 
 inline void
-bd_set (char *board, int x, int y, char c)
+bd_set (const struct geometry *g, char *board, int x, int y, char c)
 {
   assert (board != NULL);
-  assert (0 <= x && x < board_width);
-  assert (0 <= y && y < board_height);
+  assert (0 <= x && x < g->width);
+  assert (0 <= y && y < g->height);
 
-  board [x + y * board_width] = c;
+  board [x + y * g->width] = c;
 }
 
+/* The board is made a row at a time, and each row depends only on the
+ * seed, the row number and the letters picked so far. So the rows of
+ * a big board can be made as the balls reach them, and the board is
+ * the same as if it had all been made at the start.
+ */
+
 static void
-bricks_at_row (char *board, int y)
+bricks_at_row (const struct geometry *g, char *row, int y)
 {
   int x;
 
-  for (x = 2; x < board_width-2; ++x)
+  for (x = 2; x < g->width-2; ++x)
     {
       if (((x-y) % 3) != 0)
-	bd_set (board, x, y, BD_BRICK);
+	row [x] = BD_BRICK;
     }
 }
 
 static void
-bricks_along_bottom (char *board)
+brick_row (char *row, int x, int width)
 {
-  return bricks_at_row (board, board_height-1);
+  int i;
+
+  for (i = x-(width-1)/2; i <= x+(width-1)/2; ++i)
+    row [i] = BD_BRICK;
 }
 
+/* Row "y" of the brick diamond centred at (x,cy). */
 static void
-brick_row (char *board, int x, int y, int width)
+brick_diamond_at (char *row, int y, int x, int cy, int width)
 {
-  int i;
+  int i = y > cy ? y - cy : cy - y;
 
-  for (i = x-(width-1)/2; i <= x+(width-1)/2; ++i)
-    bd_set (board, i, y, BD_BRICK);
+  if (width - 2*i > 0)
+    brick_row (row, x, width - 2*i);
 }
 
+/* Put row "y" of brick pattern "pattern" into "row". */
 static void
-brick_diamond_at (char *board, int x, int y, int width)
+bricks_for_row (const struct geometry *g, char *row, int y, int pattern)
 {
-  int i;
-
-  for (i = 0; width > 0; width -= 2, i++)
+  switch (pattern)
     {
-      brick_row (board, x, y-i, width);
-      brick_row (board, x, y+i, width);
+    case 0:
+      if (y == g->height-1)
+	bricks_at_row (g, row, y);
+      brick_diamond_at (row, y, g->width/2, g->height/2, 11);
+      break;
+    case 1:
+      if (y == g->height-1)
+	bricks_at_row (g, row, y);
+      brick_diamond_at (row, y, g->width/3, g->height/3, 7);
+      brick_diamond_at (row, y, g->width*2/3, g->height/3, 7);
+      break;
+    case 2:
+      brick_diamond_at (row, y, g->width/3, g->height/3, 7);
+      brick_diamond_at (row, y, g->width*2/3, g->height/3, 7);
+      brick_diamond_at (row, y, g->width/2, g->height*2/3, 7);
+      break;
+    case 3:
+      if (y == g->height-1 ||
+	  y == g->height/5 || y == g->height*2/5 ||
+	  y == g->height*3/5 || y == g->height*4/5)
+	bricks_at_row (g, row, y);
+      break;
+    default:
+      assert (0);
     }
 }
 
-char *
-init_board (void)
+/* A seed for the random numbers of row "y" (or, with y = -1, for
+ * the board as a whole).
+ */
+static unsigned int
+row_seed (unsigned int seed, int y)
 {
-  int i, j, sz;
-  char *board = malloc (sz = board_width * board_height * sizeof (char));
-  if (board == NULL)
-    fatal_perror ("malloc");
+  unsigned int h = seed ^ ((unsigned int) (y+1) * 0x9e3779b9u);
+
+  h ^= h >> 16; h *= 0x85ebca6bu;
+  h ^= h >> 13; h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+/* Make row "y" of the board with seed "seed". Letters which have
+ * been picked already ("picked" may be NULL if none have) are left
+ * out, just as remove_letter_from_board would have removed them.
+ */
+void
+generate_board_row (const struct geometry *g, char *row, unsigned int seed,
+		    const int *picked, int y)
+{
+  unsigned int r = row_seed (seed, y);
+  int pattern = row_seed (seed, -1) % 4;
+  int i;
 
-  memset (board, BD_EMPTY, sz);
+  memset (row, BD_EMPTY, g->width);
 
   /* Put in the side walls, which are mandatory. */
-  for (j = 0; j < board_height; ++j)
+  row [0] = row [g->width-1] = BD_WALL;
+
+  if (y < ROWS_OF_BALLS)
     {
-      bd_set (board, 0, j, BD_WALL);
-      bd_set (board, board_width-1, j, BD_WALL);
+      /* Put the balls in at the top. */
+      for (i = 1; i < g->width-1; ++i)
+	row [i] = BD_BALL;
     }
+  else
+    {
+      /* Put random letters in the middle. */
+      for (i = 1; i < g->width-1; ++i)
+	row [i] = letters [rand_r (&r) % BD_NR_LETTERS];
 
-  /* Put random letters in the middle, but leave ROWS_OF_BALLS rows at the top. */
-  for (j = ROWS_OF_BALLS; j < board_height; ++j)
-    for (i = 1; i < board_width-1; ++i)
-      {
-	int c = rand () % BD_NR_LETTERS;
-	bd_set (board, i, j, letters [c]);
-      }
+      /* Scatter some doubles, negates and hearts around. */
+      for (i = 1; i < g->width-1; ++i)
+	{
+	  if ((rand_r (&r) % 16) == 0)
+	    {
+	      const char p[] = { BD_HEART, BD_DOUBLE, BD_NEGATE };
+	      row [i] = p [rand_r (&r) % 3];
+	    }
+	}
+    }
 
-  /* Scatter some doubles, negates and hearts around. */
-  for (j = ROWS_OF_BALLS; j < board_height; ++j)
-    for (i = 1; i < board_width-1; ++i)
+  /* The random pattern of bricks. */
+  bricks_for_row (g, row, y, pattern);
+
+  if (picked != NULL)
+    for (i = 1; i < g->width-1; ++i)
       {
-	if ((rand () % 16) == 0)
-	  {
-	    const char p[] = { BD_HEART, BD_DOUBLE, BD_NEGATE };
-	    int c = rand () % 3;
-	    bd_set (board, i, j, p[c]);
-	  }
+	const char *t = row [i] > BD_HEART ? strchr (letters, row [i]) : NULL;
+
+	if (t != NULL && picked [t - letters])
+	  row [i] = BD_EMPTY;
       }
+}
 
-  /* Put the balls in at the top. */
-  for (j = 0; j < ROWS_OF_BALLS; ++j)
-    for (i = 1; i < board_width-1; ++i)
-      bd_set (board, i, j, BD_BALL);
+/* Make rows "from" up to (but not including) "to" of "board". */
+void
+generate_board_rows (const struct geometry *g, char *board,
+		     unsigned int seed, const int *picked, int from, int to)
+{
+  int j;
 
-  /* Choose a random pattern of bricks. */
-  switch (rand () % 4)
-    {
-    case 0:
-      bricks_along_bottom (board);
-      brick_diamond_at (board, board_width/2, board_height/2, 11);
-      break;
-    case 1:
-      bricks_along_bottom (board);
-      brick_diamond_at (board, board_width/3, board_height/3, 7);
-      brick_diamond_at (board, board_width*2/3, board_height/3, 7);
-      break;
-    case 2:
-      brick_diamond_at (board, board_width/3, board_height/3, 7);
-      brick_diamond_at (board, board_width*2/3, board_height/3, 7);
-      brick_diamond_at (board, board_width/2, board_height*2/3, 7);
-      break;
-    case 3:
-      bricks_along_bottom (board);
-      bricks_at_row (board, board_height/5);
-      bricks_at_row (board, board_height*2/5);
-      bricks_at_row (board, board_height*3/5);
-      bricks_at_row (board, board_height*4/5);
-      break;
-    default:
-      assert (0);
-    }
+  assert (0 <= from && to <= g->height);
+  for (j = from; j < to; ++j)
+    generate_board_row (g, board + j * g->width, seed, picked, j);
+}
+
+char *
+init_board (const struct geometry *g)
+{
+  return init_board_seeded (g, rand ());
+}
+
+/* Make a new board. The same seed always gives the same board, and
+ * this does not touch the state of rand(), so it is safe to call from
+ * several threads at once.
+ */
+char *
+init_board_seeded (const struct geometry *g, unsigned int seed)
+{
+  return init_board_rows (g, seed, g->height);
+}
+
+/* Make a new board, but only the first "nr_rows" rows of it. The
+ * rest is left empty until generate_board_rows is called for it.
+ */
+char *
+init_board_rows (const struct geometry *g, unsigned int seed, int nr_rows)
+{
+  char *board = calloc (g->width * g->height, sizeof (char));
+  if (board == NULL)
+    fatal_perror ("calloc");
 
+  generate_board_rows (g, board, seed, NULL, 0, nr_rows);
   return board;
 }
 
 char *
-copy_board (const char *board)
+copy_board (const struct geometry *g, const char *board)
 {
   int sz;
-  char *copy = malloc (sz = board_width * board_height * sizeof (char));
+  char *copy = malloc (sz = g->width * g->height * sizeof (char));
   if (copy == NULL)
     fatal_perror ("malloc");
   memcpy (copy, board, sz);
   return copy;
 }
 
+/* Copy only the first "nr_rows" rows of a board. */
+char *
+copy_board_rows (const struct geometry *g, const char *board, int nr_rows)
+{
+  char *copy;
+
+  if (nr_rows >= g->height)
+    return copy_board (g, board);
+
+  copy = calloc (g->width * g->height, sizeof (char));
+  if (copy == NULL)
+    fatal_perror ("calloc");
+  memcpy (copy, board, nr_rows * g->width);
+  return copy;
+}
+
 void
 free_board (char *board)
 {
   free (board);
 }
 
-int
-count_balls_on_board (const char *board)
+/* The simulation kernels are written once below, as inline functions
+ * of the board size, and compiled once for each of the common board
+ * sizes (where the compiler knows the size and can unroll and
+ * vectorize the loops over rows) and once for any size. The board
+ * sizes are those of 60x25 and 80x24 terminals. init_geometry picks
+ * the right ones for the size of each board.
+ */
+#define KERNEL static inline __attribute__ ((always_inline))
+#define BD(x,y) board [(x) + (y) * W]
+
+KERNEL int
+count_balls_kernel (const char *board, int nr_rows, int W)
 {
-  int i, j, n = 0;
+  int c, n = 0;
 
-  for (j = 0; j < board_height; ++j)
-    for (i = 0; i < board_width; ++i)
-      if (bd_get (board, i, j) == BD_BALL)
-	n ++;
+  for (c = 0; c < nr_rows * W; ++c)
+    n += board [c] == BD_BALL;
 
   return n;
 }
 
-void
-remove_letter_from_board (char *board, int letter)
+KERNEL void
+remove_letter_kernel (char *board, int letter, int W, int H)
 {
-  int i, j;
-
-  for (j = 0; j < board_height; ++j)
-    for (i = 0; i < board_width; ++i)
-      if (bd_get (board, i, j) == letter)
-	bd_set (board, i, j, BD_EMPTY);
-}
+  const char l = letter;
+  int c;
 
-static inline int
-is_squashy_item (int c)
-{
-  return c == BD_EMPTY || c == BD_NEGATE || c == BD_DOUBLE || c == BD_HEART;
+  /* Written without a branch, so that it can be vectorized. */
+  for (c = 0; c < W * H; ++c)
+    board [c] = board [c] == l ? BD_EMPTY : board [c];
 }
 
-static void
+KERNEL void
 ball_falls_to_floor (char *board, state *state_ptr, int who_moved,
 		     int need_to_update_screen,
-		     int old_i, int old_j)
+		     int old_i, int old_j, int W)
 {
   /* Move the ball off the board. */
-  bd_set (board, old_i, old_j, BD_EMPTY);
+  BD (old_i, old_j) = BD_EMPTY;
+  STATS_ADD (ball_steps, 1);
+  TRACE (TRACE_BALL_TO_FLOOR, old_i, old_j, 0);
 
   /* Start the rolling ball animation! */
-  if (need_to_update_screen)
+  if (need_to_update_screen && animation_wanted ())
     {
+      follow_ball (old_i, old_j);
       update_screen (state_ptr);
       rolling_ball_animation (state_ptr, old_i, old_j+1, who_moved);
     }
@@ -210,19 +298,21 @@ ball_falls_to_floor (char *board, state *state_ptr, int who_moved,
   set_score  (state_ptr, who_moved, 1);
 
   /* Update the score on the screen. */
-  if (need_to_update_screen)
+  if (need_to_update_screen && animation_wanted ())
     update_screen (state_ptr);
 }
 
-static void
+KERNEL void
 ball_falls (char *board, state *state_ptr, int who_moved,
 	    int need_to_update_screen,
 	    int old_i, int old_j,
-	    int i, int j, int c)
+	    int i, int j, int c, int W)
 {
   /* Move the ball. */
-  bd_set (board, old_i, old_j, BD_EMPTY);
-  bd_set (board, i, j, BD_BALL);
+  BD (old_i, old_j) = BD_EMPTY;
+  BD (i, j) = BD_BALL;
+  STATS_ADD (ball_steps, 1);
+  TRACE (TRACE_BALL_FALLS, i, j, c);
 
   /* Update the flags and/or score, if appropriate. */
   switch (c)
@@ -238,55 +328,188 @@ ball_falls (char *board, state *state_ptr, int who_moved,
       break;
     }
 
-  /* Update the screen, if necessary. */
-  if (need_to_update_screen)
+  /* Update the screen, if necessary (and not skipped). */
+  if (need_to_update_screen && animation_wanted ())
     {
+      follow_ball (i, j);
       update_screen (state_ptr);
       short_delay (1);
     }
 }
 
-void
-drop_balls (char *board, state *state_ptr,
-	    int who_moved,
-	    int need_to_update_screen)
+/* Let the ball at (i,j) fall as far as it can: straight down if it
+ * can, else down and to the left, else down and to the right.
+ */
+KERNEL void
+ball_comes_to_rest (char *board, state *state_ptr, int who_moved,
+		    int need_to_update_screen, int i, int j, int W, int H)
 {
-  int i, j;
+  for (;;)
+    {
+      int c, di;
+
+      if (j+1 < H && j+1 >= state_ptr->rows_ready)
+	ensure_board_rows (state_ptr, j+2);
 
-  /* FIXME: checks are wrong - need to check sideways space. */
-  for (j = board_height-1; j >= 0; --j)
-    for (i = 0; i < board_width; ++i)
-      if (bd_get (board, i, j) == BD_BALL)
+      /* FIXME: checks are wrong - need to check sideways space. */
+      if (j == H-1)
 	{
-	  int c;
+	  ball_falls_to_floor (board, state_ptr, who_moved,
+			       need_to_update_screen, i, j, W);
+	  state_ptr->balls_in_play --;
+	  return;
+	}
+      else if (is_squashy_item (c = BD (i, j+1)))
+	di = 0;
+      else if (is_squashy_item (c = BD (i-1, j+1)))
+	di = -1;
+      else if (is_squashy_item (c = BD (i+1, j+1)))
+	di = 1;
+      else
+	return;
+
+      ball_falls (board, state_ptr, who_moved,
+		  need_to_update_screen, i, j, i+di, j+1, c, W);
+      i += di;
+      j ++;
+    }
+}
 
-	  /* We have a ball at (i,j). Look below - can it fall? */
-	  if (j == board_height-1)
-	    {
-	      ball_falls_to_floor (board, state_ptr, who_moved,
-				   need_to_update_screen, i, j);
-	      state_ptr->balls_in_play --;
-	    }
-	  else if (is_squashy_item (c = bd_get (board, i, j+1)))
-	    {
-	      ball_falls (board, state_ptr, who_moved,
-			  need_to_update_screen, i, j, i, j+1, c);
-	      /* Reset iterators, so we catch this ball next time round. */
-	      i --;
-	      j ++;
-	    }
-	  else if (is_squashy_item (c = bd_get (board, i-1, j+1)))
-	    {
-	      ball_falls (board, state_ptr, who_moved,
-			  need_to_update_screen, i, j, i-1, j+1, c);
-	      i -= 2;
-	      j ++;
-	    }
-	  else if (is_squashy_item (c = bd_get (board, i+1, j+1)))
-	    {
-	      ball_falls (board, state_ptr, who_moved,
-			  need_to_update_screen, i, j, i+1, j+1, c);
-	      j ++;
-	    }
+KERNEL void
+drop_balls_kernel (char *board, state *state_ptr,
+		   int who_moved,
+		   int need_to_update_screen, int W, int H)
+{
+  int j;
+
+  /* There are no balls in the rows not made yet, so start from the
+   * last row made, and make more as the balls fall into them.
+   */
+  assert (board == state_ptr->board);
+
+  /* Each ball falls all the way as soon as it is found, working up
+   * from the bottom row. The rows below are not looked at again: a
+   * ball there which could not move still cannot, since a falling
+   * ball only empties cells it could pass through anyway, and the
+   * cell it leaves is above them.
+   */
+  for (j = state_ptr->rows_ready-1; j >= 0; --j)
+    {
+      char *row = &BD (0, j), *p = row;
+
+      while ((p = memchr (p, BD_BALL, W - (p - row))) != NULL)
+	{
+	  ball_comes_to_rest (board, state_ptr, who_moved,
+			      need_to_update_screen, p - row, j, W, H);
+	  p ++;
 	}
+    }
+}
+
+#undef BD
+
+/* Make the kernels for boards of W x H, or any size if W and H are
+ * g->width and g->height.
+ */
+#define BOARD_KERNELS(name, W, H)					\
+static int								\
+count_balls_##name (const struct geometry *g, const char *board,	\
+		    int nr_rows)					\
+{									\
+  return count_balls_kernel (board, nr_rows, W);			\
+}									\
+static void								\
+remove_letter_##name (const struct geometry *g, char *board, int letter) \
+{									\
+  remove_letter_kernel (board, letter, W, H);				\
+}									\
+static void								\
+drop_balls_##name (const struct geometry *g, char *board,		\
+		   state *state_ptr, int who_moved, int need_update)	\
+{									\
+  drop_balls_kernel (board, state_ptr, who_moved, need_update, W, H);	\
+}
+
+BOARD_KERNELS (40x20, 40, 20)
+BOARD_KERNELS (60x19, 60, 19)
+BOARD_KERNELS (any, g->width, g->height)
+
+struct board_kernels {
+  int width, height;		/* Board size, or 0 for any size. */
+  int (*count_balls) (const struct geometry *, const char *, int);
+  void (*remove_letter) (const struct geometry *, char *, int);
+  void (*drop_balls) (const struct geometry *, char *, state *, int, int);
+};
+
+static const struct board_kernels board_kernels [] = {
+  { 40, 20, count_balls_40x20, remove_letter_40x20, drop_balls_40x20 },
+  { 60, 19, count_balls_60x19, remove_letter_60x19, drop_balls_60x19 },
+  { 0, 0, count_balls_any, remove_letter_any, drop_balls_any },
+};
+#define NR_BOARD_KERNELS (sizeof board_kernels / sizeof board_kernels [0])
+
+/* Set up "g" for boards of width x height, with the kernels for that
+ * size. Nothing else about a board's size is kept anywhere, so any
+ * number of games, of any sizes, can be played at once.
+ */
+void
+init_geometry (struct geometry *g, int width, int height)
+{
+  int i;
+
+  for (i = 0; i < NR_BOARD_KERNELS-1; ++i)
+    if (board_kernels [i].width == width &&
+	board_kernels [i].height == height)
+      break;
+  g->width = width;
+  g->height = height;
+  g->kernels = &board_kernels [i];
+  g->batch = find_batch_kernels (width, height);
+}
+
+int
+count_balls_on_board (const struct geometry *g, const char *board)
+{
+  return count_balls_on_rows (g, board, g->height);
+}
+
+/* Count the balls in the first "nr_rows" rows of a board. */
+int
+count_balls_on_rows (const struct geometry *g, const char *board,
+		     int nr_rows)
+{
+  return g->kernels->count_balls (g, board, nr_rows);
+}
+
+void
+remove_letter_from_board (const struct geometry *g, char *board, int letter)
+{
+  g->kernels->remove_letter (g, board, letter);
+}
+
+void
+drop_balls (char *board, state *state_ptr,
+	    int who_moved,
+	    int need_to_update_screen)
+{
+  const struct geometry *g = &state_ptr->geom;
+  STATS_ONLY (long steps_before = THREAD_STATS->ball_steps;)
+
+  TRACE_SPAN (TRACE_DROP, who_moved, state_ptr->balls_in_play, 0);
+  g->kernels->drop_balls (g, board, state_ptr, who_moved,
+			  need_to_update_screen);
+  TRACE_SPAN (TRACE_DROP_END, state_ptr->balls_in_play, 0, 0);
+
+  /* Only the moves played on the real board count as cascades, and
+   * their balls fall on this thread.
+   */
+  STATS_ONLY (if (need_to_update_screen)
+	      {
+		long steps = THREAD_STATS->ball_steps - steps_before;
+
+		STATS_ADD (cascades, 1);
+		STATS_SET (last_cascade, steps);
+		if (steps > THREAD_STATS->longest_cascade)
+		  STATS_SET (longest_cascade, steps);
+	      })
 }
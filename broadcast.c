@@ -0,0 +1,378 @@
+/* Cascade (C) 1997 Richard W.M. Jones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cascade.h"
+
+/* Broadcast the game to spectators (see watch.c) over a Unix socket.
+ *
+ * Each time the screen is updated, the cells which have changed since
+ * the last frame, and the scores and flags, are encoded once into a
+ * frame (see the FRAME_* definitions in cascade.h). At the start of
+ * each game, and whenever the frames since the last keyframe add up
+ * to as much as a keyframe, a keyframe holds the whole board instead.
+ * The frames are kept in a ring, shared by all the spectators: each
+ * spectator just has its place in the ring, and is sent from the
+ * shared frames with non-blocking writes. A spectator which falls too
+ * far behind skips ahead to the newest keyframe.
+ */
+
+#define RING_SIZE 1024		/* Frames kept. */
+#define KEYFRAME_INTERVAL 512	/* Most frames between keyframes. */
+#define MAX_SPECTATORS 1024
+
+struct frame {
+  int refs;			/* The ring, and spectators part way in. */
+  long seq;			/* Number of this frame. */
+  size_t len;
+  unsigned char data [1];	/* FRAME_HEADER bytes, then the rest. */
+};
+
+struct spectator {
+  int fd;
+  long seq;			/* Next frame to send. */
+  struct frame *frame;		/* Frame part sent, or NULL. */
+  size_t off;			/* Bytes of it sent. */
+};
+
+static int listen_fd = -1;
+static char *socket_path = NULL;
+static struct frame *ring [RING_SIZE];
+static long next_seq = 0;	/* Number of the next frame. */
+static long keyframe_seq = -1;	/* Number of the newest keyframe. */
+static size_t keyframe_len;	/* Its size, and the size of the frames */
+static size_t delta_len;	/* sent since. */
+static struct spectator spectators [MAX_SPECTATORS];
+static int nr_spectators = 0;
+
+/* The board, scores and flags as of the last frame. */
+static const state *last_state = NULL;
+static int last_scores [4];
+static char *shadow = NULL;
+static int shadow_width, shadow_height;
+
+/* Changed cells, as they are found. */
+static long *changed = NULL;
+static long changed_size = 0;
+
+int
+init_broadcast (const char *path)
+{
+  struct sockaddr_un addr;
+
+  if (strlen (path) >= sizeof addr.sun_path)
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+
+  listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd == -1)
+    return -1;
+  unlink (path);
+  if (bind (listen_fd, (struct sockaddr *) &addr, sizeof addr) == -1 ||
+      listen (listen_fd, 64) == -1)
+    {
+      close (listen_fd);
+      listen_fd = -1;
+      return -1;
+    }
+  fcntl (listen_fd, F_SETFL, O_NONBLOCK);
+
+  socket_path = strdup (path);
+  if (socket_path == NULL)
+    fatal_perror ("strdup");
+  return 0;
+}
+
+int
+broadcasting (void)
+{
+  return listen_fd != -1;
+}
+
+static void
+unref_frame (struct frame *f)
+{
+  if (f != NULL && --f->refs == 0)
+    free (f);
+}
+
+static void
+drop_spectator (int i)
+{
+  close (spectators [i].fd);
+  unref_frame (spectators [i].frame);
+  spectators [i] = spectators [--nr_spectators];
+}
+
+void
+free_broadcast (void)
+{
+  int i;
+
+  if (listen_fd == -1)
+    return;
+  while (nr_spectators > 0)
+    drop_spectator (0);
+  for (i = 0; i < RING_SIZE; ++i)
+    {
+      unref_frame (ring [i]);
+      ring [i] = NULL;
+    }
+  close (listen_fd);
+  listen_fd = -1;
+  unlink (socket_path);
+  free (socket_path);
+  free (shadow);
+  free (changed);
+}
+
+static inline unsigned char *
+put_u32 (unsigned char *p, unsigned int n)
+{
+  p [0] = n >> 24; p [1] = n >> 16; p [2] = n >> 8; p [3] = n;
+  return p + 4;
+}
+
+static struct frame *
+new_frame (int type, size_t payload)
+{
+  struct frame *f = malloc (sizeof (struct frame) + FRAME_HEADER + payload);
+
+  if (f == NULL)
+    fatal_perror ("malloc");
+  f->refs = 1;
+  f->seq = next_seq;
+  f->len = FRAME_HEADER + payload;
+  f->data [0] = type;
+  put_u32 (f->data + 1, payload);
+  return f;
+}
+
+/* Put the scores and flags after the header. */
+static unsigned char *
+put_scores (struct frame *f, const state *s)
+{
+  unsigned char *p = f->data + FRAME_HEADER;
+
+  p = put_u32 (p, s->pscore);
+  p = put_u32 (p, s->mscore);
+  *p++ = s->negate;
+  *p++ = s->dooble;
+  return p;
+}
+
+static struct frame *
+encode_keyframe (const state *s)
+{
+  int w = s->geom.width, h = s->geom.height, nr_cells = w * h;
+  struct frame *f = new_frame (FRAME_KEY, FRAME_SCORES + 8 + nr_cells);
+  unsigned char *p = put_scores (f, s);
+
+  p = put_u32 (p, w);
+  p = put_u32 (p, h);
+  memcpy (p, s->board, nr_cells);
+
+  if (shadow_width != w || shadow_height != h)
+    {
+      free (shadow);
+      shadow = malloc (nr_cells);
+      if (shadow == NULL)
+	fatal_perror ("malloc");
+      shadow_width = w;
+      shadow_height = h;
+    }
+  memcpy (shadow, s->board, nr_cells);
+  return f;
+}
+
+static void
+add_changed (long n, long c)
+{
+  if (n == changed_size)
+    {
+      changed_size = changed_size ? changed_size * 2 : 256;
+      changed = realloc (changed, changed_size * sizeof (long));
+      if (changed == NULL)
+	fatal_perror ("realloc");
+    }
+  changed [n] = c;
+}
+
+/* Returns NULL if nothing has changed. */
+static struct frame *
+encode_delta (const state *s)
+{
+  long nr_cells = (long) s->geom.width * s->rows_ready;
+  long c, n = 0;
+  struct frame *f;
+  unsigned char *p;
+  int scores [4];
+
+  /* Find the changed cells, skipping quickly over unchanged words. */
+  for (c = 0; c < nr_cells; )
+    {
+      if (c + 8 <= nr_cells &&
+	  memcmp (s->board + c, shadow + c, 8) == 0)
+	{
+	  c += 8;
+	  continue;
+	}
+      if (s->board [c] != shadow [c])
+	{
+	  add_changed (n++, c);
+	  shadow [c] = s->board [c];
+	}
+      c ++;
+    }
+
+  scores [0] = s->pscore; scores [1] = s->mscore;
+  scores [2] = s->negate; scores [3] = s->dooble;
+  if (n == 0 && memcmp (scores, last_scores, sizeof scores) == 0)
+    return NULL;
+
+  f = new_frame (FRAME_DELTA, FRAME_SCORES + 4 + 5 * n);
+  p = put_scores (f, s);
+  p = put_u32 (p, n);
+  for (c = 0; c < n; ++c)
+    {
+      p = put_u32 (p, changed [c]);
+      *p++ = shadow [changed [c]];
+    }
+  return f;
+}
+
+static void
+accept_spectators (void)
+{
+  int fd;
+
+  while ((fd = accept (listen_fd, NULL, NULL)) != -1)
+    {
+      if (nr_spectators == MAX_SPECTATORS)
+	{
+	  close (fd);
+	  continue;
+	}
+      fcntl (fd, F_SETFL, O_NONBLOCK);
+      spectators [nr_spectators].fd = fd;
+      spectators [nr_spectators].seq = -1; /* Start at a keyframe. */
+      spectators [nr_spectators].frame = NULL;
+      spectators [nr_spectators].off = 0;
+      nr_spectators ++;
+    }
+}
+
+/* Send spectator "i" as much as it will take. Returns false if it has
+ * gone away.
+ */
+static int
+send_spectator (int i)
+{
+  struct spectator *sp = &spectators [i];
+
+  for (;;)
+    {
+      ssize_t r;
+
+      if (sp->frame == NULL)
+	{
+	  if (sp->seq == next_seq || keyframe_seq == -1)
+	    return 1;		/* Up to date, or no game yet. */
+
+	  /* New, or too far behind: skip to the newest keyframe. */
+	  if (sp->seq == -1 ||
+	      next_seq - sp->seq > RING_SIZE - KEYFRAME_INTERVAL)
+	    sp->seq = keyframe_seq;
+
+	  sp->frame = ring [sp->seq % RING_SIZE];
+	  assert (sp->frame != NULL && sp->frame->seq == sp->seq);
+	  sp->frame->refs ++;
+	  sp->off = 0;
+	}
+
+      r = send (sp->fd, sp->frame->data + sp->off,
+		sp->frame->len - sp->off, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (r == -1)
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+      sp->off += r;
+      if (sp->off == sp->frame->len)
+	{
+	  unref_frame (sp->frame);
+	  sp->frame = NULL;
+	  sp->seq ++;
+	}
+    }
+}
+
+/* Take on new spectators and send what is waiting to each. */
+void
+pump_broadcast (void)
+{
+  int i;
+
+  if (listen_fd == -1)
+    return;
+  accept_spectators ();
+  for (i = 0; i < nr_spectators; )
+    if (send_spectator (i))
+      i ++;
+    else
+      drop_spectator (i);
+}
+
+/* Start again with a keyframe, for a new game. */
+void
+restart_broadcast (void)
+{
+  last_state = NULL;
+}
+
+/* Send a frame for the state "s", as it is now on the screen. */
+void
+broadcast_state (const state *s)
+{
+  struct frame *f;
+  int key;
+
+  if (listen_fd == -1)
+    return;
+
+  key = s != last_state ||
+    shadow_width != s->geom.width || shadow_height != s->geom.height ||
+    next_seq - keyframe_seq >= KEYFRAME_INTERVAL ||
+    delta_len >= keyframe_len;
+  f = key ? encode_keyframe (s) : encode_delta (s);
+  if (f == NULL)
+    return;
+  if (key)
+    {
+      keyframe_seq = next_seq;
+      keyframe_len = f->len;
+      delta_len = 0;
+    }
+  else
+    delta_len += f->len;
+  last_state = s;
+  last_scores [0] = s->pscore; last_scores [1] = s->mscore;
+  last_scores [2] = s->negate; last_scores [3] = s->dooble;
+
+  unref_frame (ring [next_seq % RING_SIZE]);
+  ring [next_seq % RING_SIZE] = f;
+  next_seq ++;
+
+  pump_broadcast ();
+}
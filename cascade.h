@@ -15,9 +15,13 @@ extern int mscore_x, mscore_y;	/* Location of machine's score. */
 extern int score_width;		/* Width of scores. */
 extern int floor_x, floor_y;	/* Location of "floor". */
 extern int board_x, board_y;	/* Location of playing board. */
-extern int board_width, board_height; /* Size of the playing board. */
+extern int board_width, board_height; /* Size of board laid out. */
+extern int virtual_width, virtual_height; /* Board size asked for, or 0. */
+extern int view_width, view_height; /* Size of the part of board shown. */
+extern int view_left, view_top;	/* Board cell at top left of the view. */
 extern int roll_y;		/* Line where balls roll along. */
 extern int roll_x_min, roll_x_max; /* Stop points for rolling balls. */
+extern int curses_only;		/* Draw with curses even on ANSI terminals. */
 
 /* Board layout. */
 
@@ -33,18 +37,267 @@ extern int roll_x_min, roll_x_max; /* Stop points for rolling balls. */
 
 extern char letters [BD_NR_LETTERS];
 
+/* Balls can fall through the empty squares and the special items. */
+static inline int
+is_squashy_item (int c)
+{
+  return c == BD_EMPTY || c == BD_NEGATE || c == BD_DOUBLE || c == BD_HEART;
+}
+
+/* The size of a board, and the simulation kernels compiled for that
+ * size (see init_geometry). Each state has its own, so that games on
+ * boards of different sizes can be played at once, on any threads.
+ */
+
+struct board_kernels;
+struct batch_kernels;
+
+struct geometry {
+  int width, height;		/* Size of the board. */
+  const struct board_kernels *kernels; /* For board.c. */
+  const struct batch_kernels *batch; /* For batch.c. */
+};
+
 /* Stuff to maintain the current state of the game. */
 
 struct state {
+  struct geometry geom;		/* Size of the board. */
   int balls_in_play;		/* Balls still on the board. */
   char *board;			/* The board itself. */
   int picked [BD_NR_LETTERS];	/* Flags for letters that are picked. */
   int pscore, mscore;		/* Player score, machine score. */
   int negate, dooble;		/* State of the negate/double flags. */
+  unsigned int seed;		/* Seed the board was made from. */
+  int rows_ready;		/* Rows of the board made so far. */
 };
 
 typedef struct state state;
 
+/* Big boards are made a few rows at a time, as the balls reach them
+ * (see ensure_board_rows). Any code which fills in a board by hand must
+ * set rows_ready to the height of the board.
+ */
+#define LAZY_ROWS 16		/* Rows made at once, beyond those needed. */
+
+/* The state after a letter is played, as worked out for all the
+ * letters at once by play_all_letters (batch.c).
+ */
+
+struct letter_result {
+  int pscore, mscore;		/* Player score, machine score. */
+  int negate, dooble;		/* State of the negate/double flags. */
+  int balls_in_play;		/* Balls still on the board. */
+};
+
+/* How choose_board_seed (choose.c) judges the boards it tries, by
+ * playing some quick random games on each.
+ */
+
+#define QUALITY_NONE 0		/* Take the first board. */
+#define QUALITY_CASCADE 1	/* Most cells changed by each move. */
+#define QUALITY_VARIANCE 2	/* Widest spread of final scores. */
+
+struct board_quality {
+  int metric;			/* One of the QUALITY_* above. */
+  int candidates;		/* Boards to try. */
+  int playouts;			/* Games played on each. */
+  double time_limit;		/* Seconds allowed for all of it. */
+};
+
+/* Many games stepped together, for training programs to play
+ * against (env.c). Moves are letter numbers, 0 to BD_NR_LETTERS-1.
+ */
+
+struct env;
+
+struct env_obs {
+  int pscore, mscore;		/* Player score, machine score. */
+  char negate, dooble;		/* State of the negate/double flags. */
+  char to_move;			/* Side to move next: 0 = player, 1 = machine. */
+  int balls_in_play;		/* Balls still on the board. */
+};
+
+/* Cells of the screen, as drawn by screen.c and ansi.c: a character
+ * and these attributes.
+ */
+#define CELL_BOLD 0x100
+#define CELL_REVERSE 0x200
+#define CELL_COLOR(n) ((n) << 10)	/* Colour pair "n", 1 to 4. */
+#define CELL_PAIR(cell) (((cell) >> 10) & 7)
+
+/* Frames broadcast to spectators (broadcast.c, watch.c). Numbers are
+ * 4 bytes, most significant first.
+ */
+#define FRAME_HEADER 5		/* Type, then length of the rest. */
+#define FRAME_SCORES 10		/* pscore, mscore, negate, double bytes. */
+#define FRAME_KEY 'K'		/* Scores, width, height, then every cell. */
+#define FRAME_DELTA 'D'		/* Scores, count, then (cell number, cell). */
+
+/* Records of games played, one row per move (records.c, query.c).
+ * Each column is kept in a file of its own, as an array in the byte
+ * order of the machine which wrote it.
+ */
+
+struct move_record {
+  unsigned int seed;		/* Seed of the board. */
+  unsigned char move;		/* Number of the move in the game, from 0. */
+  unsigned char letter;		/* Letter picked, 0 to BD_NR_LETTERS-1. */
+  unsigned char who;		/* Side which moved: 0 = player. */
+  unsigned char negate, dooble;	/* State of the flags after the move. */
+  int pdelta, mdelta;		/* Points scored by the move. */
+  int cascade;			/* Cells changed by the falling balls. */
+};
+
+struct game_record {
+  int nr_moves;
+  struct move_record moves [BD_NR_LETTERS];
+  char *before;			/* Board before the balls fell. */
+  int before_rows;
+  int pscore, mscore;		/* Scores before the balls fell. */
+};
+
+struct record_store;
+
+#define RECORD_FILES 10		/* Columns, and the index of games. */
+
+struct record_columns {
+  long nr_rows;
+  long nr_games;
+  const unsigned int *seed;
+  const unsigned char *move, *letter, *who, *negate, *dooble;
+  const int *pdelta, *mdelta;
+  const int *cascade;
+  const long *games;		/* First row of each game. */
+  void *maps [RECORD_FILES];	/* For unmap_record_columns. */
+  size_t sizes [RECORD_FILES];
+};
+
+/* A board kept on disk in bands of rows, for boards too big to keep
+ * in memory (bands.c).
+ */
+
+struct band_board;
+
+/* Parameters and results of a single search for a machine move. */
+
+struct search_tree;
+
+struct search_params {
+  int side;			/* Side to move: 0 = player, 1 = machine. */
+  int ply;			/* Number of moves ahead to search. */
+  int omit;			/* Number of good moves to omit. */
+  double budget;		/* Seconds allowed per move, 0 = no limit. */
+  double deadline;		/* Give up deepening at this time, 0 = never. */
+  int depth_reached;		/* Depth of the deepest completed search. */
+  long nodes;			/* Number of positions examined. */
+  int aborted;			/* Set if the deadline cut a search short. */
+  struct search_tree *tree;	/* Kept between moves, or NULL. */
+  int exact;			/* Find the exact value of every letter. */
+  int scores [BD_NR_LETTERS];	/* Value of each letter not picked. */
+};
+
+/* Scheduler for machine moves in many concurrent games (sched.c). */
+
+struct scheduler;
+
+typedef void (*scheduler_callback) (void *opaque, int letter,
+				    const struct search_params *);
+
+struct scheduler_metrics {
+  int queue_depth;		/* Jobs waiting now. */
+  int max_queue_depth;		/* Most jobs ever waiting at once. */
+  int busy_workers;		/* Workers searching now. */
+  long submitted;		/* Jobs submitted. */
+  long completed;		/* Jobs answered, including shed jobs. */
+  long shed;			/* Jobs answered at once, at depth 1. */
+  long degraded;		/* Jobs searched less deeply than asked. */
+  long late;			/* Jobs answered after their deadline. */
+  double total_wait, max_wait;	/* Seconds jobs spent in the queue. */
+  double total_search, max_search; /* Seconds spent searching. */
+};
+
+/* Performance counters (stats.c), compiled in with -DCASCADE_STATS.
+ * Use STATS_ADD and STATS_ONLY to update them, so that they compile
+ * away to nothing otherwise.
+ */
+
+#ifdef CASCADE_STATS
+
+struct stats {
+  long searches;		/* Machine moves searched for. */
+  long nodes;			/* Positions examined by the search. */
+  double search_time;		/* Seconds spent searching. */
+  long ball_steps;		/* Moves of one ball by one cell. */
+  long cascades;		/* Moves played on the real board. */
+  long last_cascade;		/* Ball steps in the last move played. */
+  long longest_cascade;		/* Ball steps in the longest move played. */
+  long updates;			/* Calls to update_screen. */
+  long curses_calls;		/* Calls into curses. */
+  long curses_bytes;		/* Bytes curses sent to the terminal. */
+  long last_update_calls;	/* Curses calls in the last update_screen. */
+  long last_update_bytes;	/* Bytes sent between the last two updates. */
+  double delay_time;		/* Seconds spent in short_delay. */
+};
+
+/* Each thread has its own counters (see stats.c). */
+extern __thread struct stats *thread_stats;
+extern struct stats *new_thread_stats (void);
+extern void sum_stats (struct stats *);
+
+#define THREAD_STATS (thread_stats ? thread_stats : new_thread_stats ())
+#define STATS_ONLY(x) x
+#define STATS_SET(field, v) \
+  ({ struct stats *st_ = THREAD_STATS; __typeof__ (st_->field) v_ = (v); \
+     __atomic_store (&st_->field, &v_, __ATOMIC_RELAXED); })
+#define STATS_ADD(field, n) STATS_SET (field, THREAD_STATS->field + (n))
+
+#define STATS_KEY '#'		/* Key which shows/hides the counters. */
+
+#else /* !CASCADE_STATS */
+
+#define STATS_ONLY(x)
+#define STATS_ADD(field, n) ((void) 0)
+
+#endif /* !CASCADE_STATS */
+
+/* Event tracing (trace.c), compiled in with -DCASCADE_TRACE, and
+ * turned on by setting $CASCADE_TRACE_FILE. Use TRACE for an event at
+ * the time of the span it falls in, and TRACE_SPAN for the start or
+ * end of a span, which reads the clock. Both compile away to nothing
+ * otherwise.
+ */
+
+#define TRACE_BALL_FALLS 0	/* x, y, cell fallen into. */
+#define TRACE_BALL_TO_FLOOR 1	/* x, y. */
+#define TRACE_SCORE 2		/* who, points, new score. */
+#define TRACE_NEGATE 3		/* new flag. */
+#define TRACE_DOUBLE 4		/* new flag. */
+#define TRACE_DROP 5		/* Span: who, balls in play. */
+#define TRACE_DROP_END 6	/* balls left. */
+#define TRACE_NODE 7		/* Span: letter, depth, who. */
+#define TRACE_NODE_END 8	/* value. */
+#define TRACE_NR_TYPES 9
+
+#ifdef CASCADE_TRACE
+
+extern unsigned int trace_mask;	/* Bit for each type being traced. */
+
+#define TRACE_ONLY(x) x
+#define TRACE(type, a, b, c)						\
+  (trace_mask & (1 << (type)) ? trace_event ((type), (a), (b), (c), 0)	\
+   : (void) 0)
+#define TRACE_SPAN(type, a, b, c)					\
+  (trace_mask & (1 << (type)) ? trace_event ((type), (a), (b), (c), 1)	\
+   : (void) 0)
+
+#else /* !CASCADE_TRACE */
+
+#define TRACE_ONLY(x)
+#define TRACE(type, a, b, c) ((void) 0)
+#define TRACE_SPAN(type, a, b, c) ((void) 0)
+
+#endif /* !CASCADE_TRACE */
+
 /* Global variable set when "quit" or ^C pressed. */
 
 extern volatile int quit;
@@ -55,6 +308,9 @@ extern void init_screen (void);
 extern void layout_screen (void);
 extern void draw_screen (state *);
 extern void update_screen (state *);
+extern void flush_screen (void);
+extern void start_ansi_screen (int fd);
+extern void stop_ansi_screen (void);
 extern int getkey (void);
 extern void clear_screen (void);
 extern void clear_line (int);
@@ -62,28 +318,114 @@ extern void write_centered (int, const char *);
 extern void write_screen (int, int, const char *);
 extern void free_screen (void);
 extern void rolling_ball_animation (state *, int, int, int);
-extern int count_balls_on_board (const char *board);
-extern char *init_board (void);
+extern void follow_ball (int, int);
+extern int animation_wanted (void);
+extern void end_animation (void);
+extern void flush_keys (void);
+extern void init_ansi (int fd, int width, int height);
+extern void free_ansi (void);
+extern void put_ansi_cell (int y, int x, int cell);
+extern void clear_ansi (void);
+extern void redraw_ansi (void);
+extern void flush_ansi (void);
+extern int init_broadcast (const char *path);
+extern int broadcasting (void);
+extern void restart_broadcast (void);
+extern void broadcast_state (const state *);
+extern void pump_broadcast (void);
+extern void free_broadcast (void);
+extern void scroll_view (int, int);
+extern char *init_board (const struct geometry *);
 extern state *init_state (void);
 extern state *copy_state (const state *);
 extern void free_state (state *);
-extern void generate_board_for_state (state *);
+extern void generate_board_for_state (state *, const struct geometry *);
+extern void generate_board_for_state_seeded (state *, const struct geometry *,
+					     unsigned int seed);
+extern void init_board_quality (struct board_quality *, int metric);
+extern unsigned int choose_board_seed (const struct geometry *,
+				       unsigned int seed,
+				       const struct board_quality *);
+extern void restart_state_seeded (state *, unsigned int seed);
+extern void ensure_board_rows (state *, int nr_rows);
+extern int game_over (const state *);
 extern void set_score (state *, int who, int score);
 extern void flip_negate (state *);
 extern void flip_double (state *);
-extern char bd_get (const char *, int, int);
-extern void bd_set (char *, int, int, char);
-extern char *init_board (void);
-extern char *copy_board (const char *);
+extern void init_geometry (struct geometry *, int width, int height);
+extern char bd_get (const struct geometry *, const char *, int, int);
+extern void bd_set (const struct geometry *, char *, int, int, char);
+extern char *init_board_seeded (const struct geometry *, unsigned int seed);
+extern char *init_board_rows (const struct geometry *, unsigned int seed,
+			      int nr_rows);
+extern void generate_board_row (const struct geometry *, char *,
+				unsigned int seed, const int *picked, int y);
+extern void generate_board_rows (const struct geometry *, char *,
+				 unsigned int seed, const int *picked,
+				 int from, int to);
+extern char *copy_board (const struct geometry *, const char *);
+extern char *copy_board_rows (const struct geometry *, const char *,
+			      int nr_rows);
 extern void free_board (char *);
-extern int count_balls_on_board (const char *);
-extern void remove_letter_from_board (char *, int);
+extern int count_balls_on_board (const struct geometry *, const char *);
+extern int count_balls_on_rows (const struct geometry *, const char *,
+				int nr_rows);
+extern void remove_letter_from_board (const struct geometry *, char *, int);
 extern void drop_balls (char *, state *, int who_moved, int need_update);
+extern void play_all_letters (const state *, int who, struct letter_result *);
+extern const struct batch_kernels *find_batch_kernels (int width, int height);
+extern int find_dead_letters (const state *, int *dead);
 extern void fatal (const char *);
 extern void fatal_perror (const char *);
 extern void short_delay (int);
+extern double current_time (void);
 extern int pick_machine_move (const state *);
+extern int search_machine_move (const state *, struct search_params *);
+extern void init_search_params (struct search_params *, int difficulty);
+extern struct search_tree *init_search_tree (void);
+extern void free_search_tree (struct search_tree *);
+extern struct scheduler *init_scheduler (int nr_workers, int max_queued);
+extern void free_scheduler (struct scheduler *);
+extern void schedule_machine_move (struct scheduler *, const state *,
+				   const struct search_params *,
+				   scheduler_callback, void *opaque);
+extern void get_scheduler_metrics (struct scheduler *,
+				   struct scheduler_metrics *);
+extern struct env *init_env (int nr_games, int width, int height,
+			     unsigned int seed, int opponent);
+extern void free_env (struct env *);
+extern void observe_env (struct env *, char *legal,
+			 struct env_obs *, char *boards);
+extern void step_env (struct env *, const int *moves, int *rewards,
+		      char *done, char *legal, struct env_obs *, char *boards);
+extern void init_game_record (struct game_record *, const struct geometry *);
+extern void free_game_record (struct game_record *);
+extern void begin_move_record (struct game_record *, const state *);
+extern void end_move_record (struct game_record *, const state *,
+			     int who, int letter);
+extern struct record_store *open_record_store (const char *dir);
+extern void append_game_record (struct record_store *, struct game_record *);
+extern void close_record_store (struct record_store *);
+extern int map_record_columns (const char *dir, struct record_columns *);
+extern void unmap_record_columns (struct record_columns *);
+extern struct band_board *open_band_board (const char *path, state *,
+					   const struct geometry *,
+					   unsigned int seed, int band_rows,
+					   int nr_resident);
+extern void play_letter_in_bands (struct band_board *, int who, int letter);
+extern void close_band_board (struct band_board *);
 extern void set_difficulty (int);
+#ifdef CASCADE_STATS
+extern void format_stats_hud (char *, int);
+extern void write_stats (FILE *);
+extern void dump_stats (void);
+extern void toggle_stats_hud (void);
+#endif
+#ifdef CASCADE_TRACE
+extern void start_trace (void);
+extern void stop_trace (void);
+extern void trace_event (int type, int a, int b, int c, int span);
+#endif
 extern int get_difficulty (void);
 
 #endif /* __cascade_h__ */
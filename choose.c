@@ -0,0 +1,279 @@
+/* Cascade (C) 1997 Richard W.M. Jones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cascade.h"
+
+/* Some boards make poor games: the balls all fall straight through,
+ * or hardly move at all. So try a few boards, each with a different
+ * seed, and play some quick random games on each, on all processors
+ * at once. Then keep the board which did best, out of those finished
+ * within the time limit.
+ *
+ * The other processors' threads are started the first time, and are
+ * kept waiting for the next game's boards after that.
+ */
+
+#define DEFAULT_CANDIDATES 32
+#define DEFAULT_PLAYOUTS 4
+#define DEFAULT_TIME_LIMIT 0.05
+
+struct choice {
+  const struct geometry *geom;
+  const struct board_quality *q;
+  unsigned int seed;
+  double deadline;
+  long next;			/* Next candidate to hand out. */
+  double *value;		/* Value of each candidate, or -1. */
+};
+
+/* Space for playing out the candidates on one thread. */
+struct workspace {
+  state *s;
+  char *before;
+  int nr_cells;
+};
+
+/* The worker threads. Each one judges candidates for every choice
+ * posted, so "busy" is set to the number of workers when a choice is
+ * posted, and the choice is finished when it is back to 0.
+ */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work;		/* Signalled when a choice is posted. */
+  pthread_cond_t done;		/* Signalled when "busy" reaches 0. */
+  int nr_workers;
+  struct choice *c;		/* The choice posted last. */
+  unsigned long posted;		/* Number of choices posted. */
+  int busy;			/* Workers yet to finish "c". */
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	   PTHREAD_COND_INITIALIZER };
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+void
+init_board_quality (struct board_quality *q, int metric)
+{
+  q->metric = metric;
+  q->candidates = DEFAULT_CANDIDATES;
+  q->playouts = DEFAULT_PLAYOUTS;
+  q->time_limit = DEFAULT_TIME_LIMIT;
+}
+
+static unsigned int
+candidate_seed (unsigned int seed, int k)
+{
+  return seed ^ ((unsigned int) k * 0x9e3779b9u);
+}
+
+/* Play a random game from "start", using "s" and "before" for
+ * space. Returns false if the deadline passes first.
+ */
+static int
+playout (const state *start, state *s, char *before, unsigned int rng,
+	 double deadline, long *moves, long *cells_changed, int *margin)
+{
+  int nr_cells = start->geom.width * start->geom.height;
+  char *board = s->board;
+  int who = 0;
+
+  memcpy (s, start, sizeof (state));
+  s->board = board;
+  memcpy (board, start->board, nr_cells);
+
+  while (!game_over (s))
+    {
+      int i, n = 0, choice [BD_NR_LETTERS];
+
+      if (current_time () >= deadline)
+	return 0;
+
+      for (i = 0; i < BD_NR_LETTERS; ++i)
+	if (!s->picked [i])
+	  choice [n++] = i;
+      i = choice [rand_r (&rng) % n];
+
+      s->picked [i] = 1;
+      remove_letter_from_board (&s->geom, board, letters [i]);
+      memcpy (before, board, nr_cells);
+      drop_balls (board, s, who, 0);
+
+      for (i = 0; i < nr_cells; ++i)
+	*cells_changed += before [i] != board [i];
+      (*moves) ++;
+      who = !who;
+    }
+  *margin = s->pscore - s->mscore;
+  return 1;
+}
+
+/* The value of candidate "k", or -1 if it could not be finished. */
+static double
+judge_candidate (struct choice *c, int k, state *s, char *before)
+{
+  const struct board_quality *q = c->q;
+  unsigned int seed = candidate_seed (c->seed, k);
+  long moves = 0, cells_changed = 0;
+  double sum = 0, sum_squared = 0, value = -1;
+  state *start;
+  int p;
+
+  start = init_state ();
+  generate_board_for_state_seeded (start, c->geom, seed);
+
+  for (p = 0; p < q->playouts; ++p)
+    {
+      int margin;
+
+      if (!playout (start, s, before, seed + p, c->deadline,
+		    &moves, &cells_changed, &margin))
+	break;
+      sum += margin;
+      sum_squared += (double) margin * margin;
+    }
+
+  if (p == q->playouts)
+    {
+      if (q->metric == QUALITY_CASCADE)
+	value = moves ? (double) cells_changed / moves : 0;
+      else
+	value = sum_squared / p - (sum / p) * (sum / p);
+    }
+
+  free_state (start);
+  return value;
+}
+
+static void
+judge_candidates (struct choice *c, struct workspace *ws)
+{
+  int nr_cells = c->geom->width * c->geom->height;
+  long k;
+
+  if (ws->s == NULL)
+    ws->s = init_state ();
+  if (ws->nr_cells < nr_cells)
+    {
+      free_board (ws->s->board);
+      free (ws->before);
+      ws->s->board = malloc (nr_cells);
+      ws->before = malloc (nr_cells);
+      if (ws->s->board == NULL || ws->before == NULL)
+	fatal_perror ("malloc");
+      ws->nr_cells = nr_cells;
+    }
+
+  while ((k = __sync_fetch_and_add (&c->next, 1)) < c->q->candidates &&
+	 current_time () < c->deadline)
+    c->value [k] = judge_candidate (c, k, ws->s, ws->before);
+}
+
+static void *
+worker (void *vp)
+{
+  struct workspace ws = { NULL, NULL, 0 };
+  unsigned long seen = 0;
+  struct choice *c;
+
+  pthread_mutex_lock (&pool.lock);
+  for (;;)
+    {
+      while (pool.posted == seen)
+	pthread_cond_wait (&pool.work, &pool.lock);
+      seen = pool.posted;
+      c = pool.c;
+      pthread_mutex_unlock (&pool.lock);
+
+      judge_candidates (c, &ws);
+
+      pthread_mutex_lock (&pool.lock);
+      if (--pool.busy == 0)
+	pthread_cond_broadcast (&pool.done);
+    }
+  return NULL;
+}
+
+/* Start a worker on each of the other processors. */
+static void
+start_pool (void)
+{
+  int i, n = sysconf (_SC_NPROCESSORS_ONLN) - 1;
+  pthread_t thread;
+
+  for (i = 0; i < n; ++i)
+    {
+      if (pthread_create (&thread, NULL, worker, NULL) != 0)
+	fatal ("cannot create thread");
+      pthread_detach (thread);
+      pool.nr_workers ++;
+    }
+}
+
+/* Choose the seed of a good board, starting from "seed". The same
+ * seed may not always give the same choice, since that depends on how
+ * many boards are tried in time. Boards too big to make at once (see
+ * ensure_board_rows) are not judged, and "seed" is used as it is.
+ */
+unsigned int
+choose_board_seed (const struct geometry *g, unsigned int seed,
+		   const struct board_quality *q)
+{
+  struct choice c;
+  struct workspace ws = { NULL, NULL, 0 };
+  int i, best = 0, lazy;
+  state *probe;
+
+  if (q->metric == QUALITY_NONE || q->candidates <= 1 || q->playouts < 1)
+    return seed;
+
+  probe = init_state ();
+  generate_board_for_state_seeded (probe, g, seed);
+  lazy = probe->rows_ready < g->height;
+  free_state (probe);
+  if (lazy)
+    return seed;
+
+  c.geom = g;
+  c.q = q;
+  c.seed = seed;
+  c.deadline = current_time () + q->time_limit;
+  c.next = 0;
+  c.value = malloc (q->candidates * sizeof (double));
+  if (c.value == NULL)
+    fatal_perror ("malloc");
+  for (i = 0; i < q->candidates; ++i)
+    c.value [i] = -1;
+
+  /* Wait for any other choice to finish, then post this one. This
+   * thread judges candidates too.
+   */
+  pthread_once (&pool_once, start_pool);
+  pthread_mutex_lock (&pool.lock);
+  while (pool.busy > 0)
+    pthread_cond_wait (&pool.done, &pool.lock);
+  pool.c = &c;
+  pool.posted ++;
+  pool.busy = pool.nr_workers;
+  pthread_cond_broadcast (&pool.work);
+  pthread_mutex_unlock (&pool.lock);
+
+  judge_candidates (&c, &ws);
+
+  pthread_mutex_lock (&pool.lock);
+  while (pool.busy > 0)
+    pthread_cond_wait (&pool.done, &pool.lock);
+  pthread_mutex_unlock (&pool.lock);
+
+  for (i = 1; i < q->candidates; ++i)
+    if (c.value [i] > c.value [best])
+      best = i;
+
+  free (ws.before);
+  free_state (ws.s);
+  free (c.value);
+  return candidate_seed (seed, best);
+}
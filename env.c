@@ -0,0 +1,187 @@
+/* Cascade (C) 1997 Richard W.M. Jones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "cascade.h"
+
+/* Many independent games, stepped together with one move for each
+ * game per call, for programs which learn to play. Nothing is drawn,
+ * and once made, an env allocates nothing as it is stepped (except
+ * for the deeper searches of opponents at levels 4 and 5).
+ *
+ * The states are kept in one array and the boards in one block, so
+ * the games lie next to each other in memory. A game which finishes
+ * is started again at once on a new board, seeded from a counter.
+ *
+ * An env is not locked: use one env per thread.
+ */
+
+struct env {
+  struct geometry geom;
+  int nr_games;
+  int opponent;			/* Difficulty of the machine, or 0. */
+  unsigned int next_seed;	/* Seed for the next new game. */
+  state *states;
+  char *boards;
+  char *to_move;		/* Side to move in each game. */
+};
+
+/* Make "nr_games" games, on boards of "width" x "height".
+ * If "opponent" is 0, each move is played by the side whose turn it
+ * is, so the caller plays both sides. Otherwise the caller is the
+ * player, and the machine at that difficulty answers each move.
+ */
+struct env *
+init_env (int nr_games, int width, int height, unsigned int seed,
+	  int opponent)
+{
+  size_t nr_cells = (size_t) width * height;
+  struct env *env;
+  int g;
+
+  assert (nr_games > 0);
+  assert (0 <= opponent && opponent <= 5);
+
+  env = malloc (sizeof (struct env));
+  if (env == NULL)
+    fatal_perror ("malloc");
+  init_geometry (&env->geom, width, height);
+  env->nr_games = nr_games;
+  env->opponent = opponent;
+  env->next_seed = seed;
+  env->states = calloc (nr_games, sizeof (state));
+  env->boards = calloc (nr_games, nr_cells);
+  env->to_move = calloc (nr_games, 1);
+  if (env->states == NULL || env->boards == NULL || env->to_move == NULL)
+    fatal_perror ("malloc");
+
+  for (g = 0; g < nr_games; ++g)
+    {
+      env->states [g].geom = env->geom;
+      env->states [g].board = env->boards + g * nr_cells;
+      restart_state_seeded (&env->states [g], env->next_seed++);
+    }
+  return env;
+}
+
+void
+free_env (struct env *env)
+{
+  free (env->to_move);
+  free (env->boards);
+  free (env->states);
+  free (env);
+}
+
+/* Fill in what the caller sees of game "g". Any of the buffers may be
+ * NULL: "legal" has BD_NR_LETTERS flags per game, set for the letters
+ * which may be played, and "boards" has every cell of each board.
+ */
+static void
+observe_game (struct env *env, int g, char *legal,
+	      struct env_obs *obs, char *boards)
+{
+  size_t nr_cells = (size_t) env->geom.width * env->geom.height;
+  state *s = &env->states [g];
+  int i;
+
+  if (legal)
+    for (i = 0; i < BD_NR_LETTERS; ++i)
+      legal [g * BD_NR_LETTERS + i] = !s->picked [i];
+  if (obs)
+    {
+      obs [g].pscore = s->pscore;
+      obs [g].mscore = s->mscore;
+      obs [g].negate = s->negate;
+      obs [g].dooble = s->dooble;
+      obs [g].to_move = env->to_move [g];
+      obs [g].balls_in_play = s->balls_in_play;
+    }
+  if (boards)
+    {
+      ensure_board_rows (s, env->geom.height);
+      memcpy (boards + g * nr_cells, s->board, nr_cells);
+    }
+}
+
+void
+observe_env (struct env *env, char *legal, struct env_obs *obs, char *boards)
+{
+  int g;
+
+  for (g = 0; g < env->nr_games; ++g)
+    observe_game (env, g, legal, obs, boards);
+}
+
+/* How far "who" is ahead. */
+static inline int
+lead (const state *s, int who)
+{
+  return who == 0 ? s->pscore - s->mscore : s->mscore - s->pscore;
+}
+
+static void
+play (state *s, int who, int i)
+{
+  s->picked [i] = 1;
+  remove_letter_from_board (&s->geom, s->board, letters [i]);
+  drop_balls (s->board, s, who, 0);
+}
+
+/* The machine's answer. Deeper searches are not given a time limit,
+ * so that the same moves always get the same answers.
+ */
+static int
+machine_reply (const state *s, int level)
+{
+  struct search_params params;
+
+  init_search_params (&params, level);
+  return strchr (letters, search_machine_move (s, &params)) - letters;
+}
+
+/* Play moves [g] in each game g. A letter which has been picked
+ * already is taken to mean the first letter which has not. The
+ * reward is the change in the lead of the side which moved, after
+ * the machine's answer if there is an opponent. Games which are over
+ * have "done" set and are started again, and the observations are
+ * then of the new game. Any of the buffers after "moves" may be NULL.
+ */
+void
+step_env (struct env *env, const int *moves, int *rewards, char *done,
+	  char *legal, struct env_obs *obs, char *boards)
+{
+  int g;
+
+  for (g = 0; g < env->nr_games; ++g)
+    {
+      state *s = &env->states [g];
+      int who = env->to_move [g], m = moves [g], before, over;
+
+      if (m < 0 || m >= BD_NR_LETTERS || s->picked [m])
+	for (m = 0; s->picked [m]; ++m)
+	  ;
+
+      before = lead (s, who);
+      play (s, who, m);
+      if (env->opponent && !game_over (s))
+	play (s, 1, machine_reply (s, env->opponent));
+      else if (!env->opponent)
+	env->to_move [g] = !who;
+
+      if (rewards)
+	rewards [g] = lead (s, who) - before;
+      over = game_over (s);
+      if (done)
+	done [g] = over;
+      if (over)
+	{
+	  restart_state_seeded (s, env->next_seed++);
+	  env->to_move [g] = 0;
+	}
+      observe_game (env, g, legal, obs, boards);
+    }
+}
@@ -15,40 +15,90 @@ typedef int (*__compar_fn_t)(const void *data1, const void *data2);
 #define NEGATE_BIAS 5
 #define IMPOSSIBLE -10000
 
+/* Bounds for the alpha-beta window. These must lie outside any score
+ * that a real position can produce.
+ */
+#define LOWEST_SCORE -1000000000
+#define HIGHEST_SCORE 1000000000
+
+/* How often (in nodes) the search looks at the clock. */
+#define DEADLINE_CHECK_INTERVAL 256
+
+/* Search trees kept between moves (see move_tree_root). Only nodes
+ * searched at least MIN_TREE_DEPTH deep are kept: below that, the
+ * values of the children are no better than the ones play_all_letters
+ * gives anyway.
+ */
+#define MIN_TREE_DEPTH 2
+#define MAX_TREE_NODES 16384
+#define NO_VALUE (LOWEST_SCORE-1)
+
+struct tree_node {
+  int depth;			/* Depth the values come from, or 0. */
+  int value [BD_NR_LETTERS];	/* Value of each child, or NO_VALUE. */
+  int child [BD_NR_LETTERS];	/* Node of each child, or 0. */
+};
+
+struct search_tree {
+  struct tree_node *nodes;	/* Node 0 is not used. */
+  int nr_nodes, size;
+  int root;			/* Node of the position below, or 0. */
+  int side;			/* Side the values are for. */
+  int move;			/* Letter played from the root, or -1. */
+  unsigned int seed;		/* The position at the root. */
+  int width, height;
+  int picked [BD_NR_LETTERS];
+};
+
 /* Difficulty level controls. */
-static int ply = 1;		/* Number of moves ahead to search. */
-static int omit = 3;		/* Number of good moves to omit. */
 static int difficulty = 1;	/* Current level of difficulty. */
 
 /* Function prototypes. */
-static void search (const state *state_ptr, int depth, int *scores_rtn);
+static void search (const state *state_ptr, int depth, int *scores_rtn,
+		    const int *previous_scores, struct search_params *params);
+static int search_node (const state *state_ptr, int who, int depth,
+			int alpha, int beta, struct search_params *params,
+			int node);
+static void move_tree_root (struct search_tree *tree, const state *state_ptr,
+			    int side);
 
 void
 set_difficulty (int d)
 {
   assert (1 <= d && d <= 5);
+  difficulty = d;
+}
+
+int
+get_difficulty (void)
+{
+  return difficulty;
+}
+
+/* Fill in the search parameters for difficulty level "d". */
+void
+init_search_params (struct search_params *params, int d)
+{
+  assert (1 <= d && d <= 5);
+  memset (params, 0, sizeof (struct search_params));
+  params->side = 1;
   switch (d)
     {
     case 1:
-      ply = 1; omit = 3; break;
+      params->ply = 1; params->omit = 3; break;
     case 2:
-      ply = 1; omit = 1; break;
+      params->ply = 1; params->omit = 1; break;
     case 3:
-      ply = 1; omit = 0; break;
+      params->ply = 1; params->omit = 0; break;
 
-      /* If ply > 1, then omit must be 0. */
+      /* If ply > 1, then omit must be 0. Deeper searches are given a
+       * time budget, so that the machine still moves promptly.
+       */
     case 4:
-      ply = 3; omit = 0; break;
+      params->ply = 3; params->omit = 0; params->budget = 1.0; break;
     case 5:
-      ply = 5; omit = 0; break;
+      params->ply = 5; params->omit = 0; params->budget = 3.0; break;
     }
-  difficulty = d;
-}
-
-int
-get_difficulty (void)
-{
-  return difficulty;
 }
 
 static int
@@ -62,18 +112,73 @@ compare_s_and_l_elements (const int *n1, const int *n2)
  */
 int
 pick_machine_move (const state *state_ptr)
+{
+  struct search_params params;
+
+  init_search_params (&params, difficulty);
+  if (params.budget > 0)
+    params.deadline = current_time () + params.budget;
+  return search_machine_move (state_ptr, &params);
+}
+
+/* Work out a move for the machine using the explicit search
+ * parameters in "params". Deeper searches are tried in turn (only odd
+ * depths, so that every leaf follows a machine move) until "ply" is
+ * reached or the deadline passes, in which case the result of the
+ * last complete search is used. On return, "depth_reached" and
+ * "nodes" describe the work done, and "scores" holds the value of
+ * each letter. Those values are only exact for the best letter unless
+ * "exact" is set, which searches every letter with a full window.
+ */
+int
+search_machine_move (const state *state_ptr, struct search_params *params)
 {
   int scores [BD_NR_LETTERS];
+  int best_scores [BD_NR_LETTERS];
   int scores_and_letters [BD_NR_LETTERS][2];
-  int i, pick;
+  int i, pick, depth;
+  const int *previous_scores = NULL;
+  STATS_ONLY (double started = current_time ();)
+
+  assert (params->ply >= 1);
+  assert (params->ply == 1 || params->omit == 0);
+
+  params->nodes = 0;
+  params->aborted = 0;
+  params->depth_reached = 0;
+  if (params->tree)
+    move_tree_root (params->tree, state_ptr, params->side);
+
+  for (depth = 1; depth <= params->ply; depth += 2)
+    {
+      /* Search for the scores from removing each possible letter. */
+      search (state_ptr, depth, scores, previous_scores, params);
+      if (params->aborted)
+	break;
+
+      memcpy (best_scores, scores, sizeof scores);
+      params->depth_reached = depth;
+
+      /* Try the most promising letters first next time round. */
+      previous_scores = best_scores;
+
+      if (params->deadline > 0 && current_time () >= params->deadline)
+	break;
+    }
+
+  /* Depth 1 is never abandoned, so we always have some scores. */
+  assert (params->depth_reached >= 1);
 
-  /* Search for the scores from removing each possible letter. */
-  search (state_ptr, ply, scores);
+  STATS_ADD (searches, 1);
+  STATS_ADD (nodes, params->nodes);
+  STATS_ADD (search_time, current_time () - started);
+
+  memcpy (params->scores, best_scores, sizeof best_scores);
 
   /* Sort 'em. */
   for (i = 0; i < BD_NR_LETTERS; ++i)
     {
-      scores_and_letters [i][0] = scores [i];
+      scores_and_letters [i][0] = best_scores [i];
       scores_and_letters [i][1] = letters [i];
     }
   qsort (scores_and_letters,
@@ -81,40 +186,445 @@ pick_machine_move (const state *state_ptr)
 	 (__compar_fn_t) compare_s_and_l_elements);
 
   /* Pick the top nth one. */
-  pick = omit;
+  pick = params->omit;
   while (scores_and_letters [pick][0] == IMPOSSIBLE)
     pick --;
   assert (pick >= 0);
+  if (params->tree)
+    params->tree->move = strchr (letters, scores_and_letters [pick][1])
+      - letters;
   return scores_and_letters [pick][1];
 }
 
-/* Search down to depth. */
+/* A deep search has already looked at the positions which can come
+ * up when the machine is next to move, two plies further on. So the
+ * search keeps the value it found for each child of the positions
+ * near the root, and at the next move, the part of the tree under the
+ * moves actually played becomes the new root and the rest is thrown
+ * away. Most of the values are only bounds, and come from a shallower
+ * search than the new one, so they are used just to try the best
+ * children first, which makes the new search cut off sooner. Each
+ * deeper search within one move uses the tree in the same way.
+ *
+ * A tree is not locked: use one per game, on one thread at a time.
+ */
+struct search_tree *
+init_search_tree (void)
+{
+  struct search_tree *tree = malloc (sizeof (struct search_tree));
+
+  if (tree == NULL)
+    fatal_perror ("malloc");
+  memset (tree, 0, sizeof (struct search_tree));
+  tree->move = -1;
+  return tree;
+}
 
-static void
-search (const state *state_ptr, int depth, int *scores_rtn)
+void
+free_search_tree (struct search_tree *tree)
 {
+  if (tree != NULL)
+    {
+      free (tree->nodes);
+      free (tree);
+    }
+}
+
+/* Returns a new node, or 0 if the tree is full. */
+static int
+new_tree_node (struct search_tree *tree)
+{
+  struct tree_node *n;
   int i;
 
-  assert (depth == 1);
+  if (tree->nr_nodes == tree->size)
+    {
+      if (tree->size == MAX_TREE_NODES)
+	return 0;
+      tree->size = tree->size ? tree->size * 2 : 256;
+      tree->nodes = realloc (tree->nodes,
+			     tree->size * sizeof (struct tree_node));
+      if (tree->nodes == NULL)
+	fatal_perror ("realloc");
+    }
+  if (tree->nr_nodes == 0)
+    tree->nr_nodes = 1;
 
+  n = &tree->nodes [tree->nr_nodes];
+  n->depth = 0;
   for (i = 0; i < BD_NR_LETTERS; ++i)
     {
+      n->value [i] = NO_VALUE;
+      n->child [i] = 0;
+    }
+  return tree->nr_nodes++;
+}
+
+/* The node for child "i" of "node", made if need be, or 0. */
+static int
+tree_child (struct search_tree *tree, int node, int i)
+{
+  int c = tree->nodes [node].child [i];
+
+  if (c == 0 && (c = new_tree_node (tree)) != 0)
+    tree->nodes [node].child [i] = c;
+  return c;
+}
+
+/* Copy node "k" and all below it, numbered from "*n" on. */
+static int
+copy_subtree (const struct tree_node *from, struct tree_node *to,
+	      int *n, int k)
+{
+  int i, m = (*n)++;
+
+  to [m] = from [k];
+  for (i = 0; i < BD_NR_LETTERS; ++i)
+    if (from [k].child [i])
+      to [m].child [i] = copy_subtree (from, to, n, from [k].child [i]);
+  return m;
+}
+
+/* Make the root of the tree the position "state_ptr". If it follows
+ * from the old root by the move the machine chose and one reply, the
+ * subtree for it is kept, and everything else is freed at once.
+ */
+static void
+move_tree_root (struct search_tree *tree, const state *state_ptr, int side)
+{
+  int i, reply = -1, root = 0;
+
+  if (tree->root && tree->move >= 0 && tree->side == side &&
+      tree->seed == state_ptr->seed &&
+      tree->width == state_ptr->geom.width &&
+      tree->height == state_ptr->geom.height)
+    {
+      for (i = 0; i < BD_NR_LETTERS; ++i)
+	if (state_ptr->picked [i] != tree->picked [i] && i != tree->move)
+	  reply = reply == -1 && state_ptr->picked [i] ? i : -2;
+      if (reply >= 0 && state_ptr->picked [tree->move] &&
+	  !tree->picked [tree->move])
+	{
+	  root = tree->nodes [tree->root].child [tree->move];
+	  if (root)
+	    root = tree->nodes [root].child [reply];
+	}
+    }
+
+  if (root)
+    {
+      struct tree_node *nodes = malloc (tree->size * sizeof (struct tree_node));
+      int n = 1;
+
+      if (nodes == NULL)
+	fatal_perror ("malloc");
+      tree->root = copy_subtree (tree->nodes, nodes, &n, root);
+      free (tree->nodes);
+      tree->nodes = nodes;
+      tree->nr_nodes = n;
+    }
+  else
+    {
+      tree->nr_nodes = 0;
+      tree->root = new_tree_node (tree);
+    }
+
+  tree->side = side;
+  tree->move = -1;
+  tree->seed = state_ptr->seed;
+  tree->width = state_ptr->geom.width;
+  tree->height = state_ptr->geom.height;
+  memcpy (tree->picked, state_ptr->picked, sizeof tree->picked);
+}
+
+/* The value of a position from the point of view of "side". The
+ * flags count for whoever moved last, since they hurt the next
+ * player to move.
+ */
+static inline int
+evaluate_scores (int pscore, int mscore, int negate, int dooble,
+		 int who_moved, int side)
+{
+  int bias = negate ? (dooble ? DOUBLE_NEGATE_BIAS : NEGATE_BIAS) : 0;
+  int v = mscore - pscore + (who_moved == 1 ? bias : -bias);
+
+  return side == 1 ? v : -v;
+}
+
+static inline int
+evaluate (const state *s, int who_moved, int side)
+{
+  return evaluate_scores (s->pscore, s->mscore, s->negate, s->dooble,
+			  who_moved, side);
+}
+
+static inline int
+evaluate_result (const struct letter_result *r, int who_moved, int side)
+{
+  return evaluate_scores (r->pscore, r->mscore, r->negate, r->dooble,
+			  who_moved, side);
+}
+
+/* Make the state which results from "who" removing letter "i". */
+static state *
+play_child (const state *state_ptr, int who, int i)
+{
+  state *s = copy_state (state_ptr);
+
+  s->picked [i] = 1;
+  remove_letter_from_board (&s->geom, s->board, letters [i]);
+  drop_balls (s->board, s, who, 0);
+  return s;
+}
+
+/* Returns true if the search has run out of time. */
+static int
+out_of_time (struct search_params *params)
+{
+  params->nodes ++;
+  if (params->deadline > 0 &&
+      (params->nodes % DEADLINE_CHECK_INTERVAL) == 0 &&
+      current_time () >= params->deadline)
+    params->aborted = 1;
+  return params->aborted;
+}
+
+/* Search down to depth. "params->side" moves at the root, and
+ * "scores_rtn" contains the value of each letter for that side, or
+ * IMPOSSIBLE if the letter has been picked already.
+ */
+
+static void
+search (const state *state_ptr, int depth, int *scores_rtn,
+	const int *previous_scores, struct search_params *params)
+{
+  struct search_tree *tree = params->tree;
+  int i, k, alpha = LOWEST_SCORE;
+  int order [BD_NR_LETTERS];
+  int dead [BD_NR_LETTERS], first_dead = -1;
+
+  /* Looking one move ahead, all the letters can be tried at once. */
+  if (depth == 1)
+    {
+      struct letter_result results [BD_NR_LETTERS];
+
+      play_all_letters (state_ptr, params->side, results);
+      for (i = 0; i < BD_NR_LETTERS; ++i)
+	if (! state_ptr->picked [i])
+	  {
+	    params->nodes ++;
+	    scores_rtn [i] = evaluate_result (&results [i], params->side,
+					      params->side);
+	  }
+	else
+	  scores_rtn [i] = IMPOSSIBLE;
+      return;
+    }
+
+  /* Visit the letters in order of their scores from the previous,
+   * shallower search, or from the search at the last move if that
+   * went deeper.
+   */
+  for (i = 0; i < BD_NR_LETTERS; ++i)
+    order [i] = i;
+  if (tree && tree->nodes [tree->root].depth >= depth-2)
+    previous_scores = tree->nodes [tree->root].value;
+  if (previous_scores != NULL)
+    for (i = 1; i < BD_NR_LETTERS; ++i)
+      for (k = i; k > 0 &&
+	     previous_scores [order [k]] > previous_scores [order [k-1]]; --k)
+	{
+	  int t = order [k]; order [k] = order [k-1]; order [k-1] = t;
+	}
+
+  find_dead_letters (state_ptr, dead);
+
+  for (k = 0; k < BD_NR_LETTERS; ++k)
+    {
+      i = order [k];
+
       if (! state_ptr->picked [i])
 	{
-	  int letter = letters [i];
-	  state *s = copy_state (state_ptr);
-
-	  remove_letter_from_board (s->board, letter);
-	  drop_balls (s->board, s, 1, 0);
-	  scores_rtn [i] = s->mscore - s->pscore
-	    + (s->negate ?
-	       (s->dooble ?
-		DOUBLE_NEGATE_BIAS :
-		NEGATE_BIAS)
-	       : 0);
+	  state *s;
+	  int v;
+
+	  /* All the letters which no ball can reach are the same move,
+	   * so search only the first of them.
+	   */
+	  if (dead [i])
+	    {
+	      if (first_dead >= 0)
+		{
+		  scores_rtn [i] = scores_rtn [first_dead];
+		  continue;
+		}
+	      first_dead = i;
+	    }
+
+	  TRACE_SPAN (TRACE_NODE, i, depth, params->side);
+	  s = play_child (state_ptr, params->side, i);
+
+	  if (s->balls_in_play == 0)
+	    {
+	      params->nodes ++;
+	      v = evaluate (s, params->side, params->side);
+	    }
+	  else
+	    {
+	      int child = 0;
+
+	      if (tree && depth-1 >= MIN_TREE_DEPTH)
+		child = tree_child (tree, tree->root, i);
+	      v = search_node (s, !params->side, depth-1,
+			       alpha, HIGHEST_SCORE, params, child);
+
+	      /* A letter which failed low is only known to be no better
+	       * than the best so far, so make sure it sorts below it.
+	       */
+	      if (v <= alpha)
+		v --;
+	    }
+	  if (v > alpha && !params->exact)
+	    alpha = v;
+	  scores_rtn [i] = v;
 	  free_state (s);
+	  TRACE_SPAN (TRACE_NODE_END, v, 0, 0);
+
+	  if (params->aborted)
+	    return;
 	}
       else
 	scores_rtn [i] = IMPOSSIBLE;
     }
+
+  if (tree)
+    {
+      tree->nodes [tree->root].depth = depth;
+      memcpy (tree->nodes [tree->root].value, scores_rtn,
+	      sizeof tree->nodes [tree->root].value);
+    }
+}
+
+/* Alpha-beta search of the position "state_ptr", with "who" to move.
+ * Values are from the point of view of "params->side", so that side
+ * maximizes and the other minimizes. Children are tried best-first
+ * according to their immediate value, or their value in the search
+ * tree "node" if they have one, and the boards for them are only made
+ * if they have to be searched further.
+ */
+static int
+search_node (const state *state_ptr, int who, int depth,
+	     int alpha, int beta, struct search_params *params, int node)
+{
+  struct search_tree *tree = params->tree;
+  struct letter_result results [BD_NR_LETTERS];
+  int children [BD_NR_LETTERS];
+  int values [BD_NR_LETTERS];
+  int keys [BD_NR_LETTERS];
+  char known [BD_NR_LETTERS];
+  int dead [BD_NR_LETTERS];
+  int i, k, n = 0, best, have_dead = 0, record = 0;
+  int maximize = who == params->side;
+
+  if (out_of_time (params))
+    return 0;
+
+  /* Values from a search as deep as this one, or deeper, are kept. */
+  if (node && depth >= tree->nodes [node].depth)
+    {
+      tree->nodes [node].depth = depth;
+      record = 1;
+    }
+
+  /* Only one of the letters which no ball can reach need be tried.
+   * (At depth 1 they cost nothing to evaluate, so don't look.)
+   */
+  if (depth > 1)
+    find_dead_letters (state_ptr, dead);
+  else
+    memset (dead, 0, sizeof dead);
+
+  play_all_letters (state_ptr, who, results);
+  for (i = 0; i < BD_NR_LETTERS; ++i)
+    if (! state_ptr->picked [i])
+      {
+	int v = evaluate_result (&results [i], who, params->side);
+	int key = v, kept = 0;
+
+	if (dead [i])
+	  {
+	    if (have_dead)
+	      continue;
+	    have_dead = 1;
+	  }
+	if (node && tree->nodes [node].value [i] != NO_VALUE)
+	  {
+	    key = tree->nodes [node].value [i];
+	    kept = 1;
+	  }
+
+	/* Insertion sort, best for "who" first. Children searched before
+	 * come first, since their values allow for the replies.
+	 */
+	for (k = n; k > 0 &&
+	       (kept > known [k-1] ||
+		(kept == known [k-1] &&
+		 (maximize ? key > keys [k-1] : key < keys [k-1]))); --k)
+	  {
+	    children [k] = children [k-1];
+	    values [k] = values [k-1];
+	    keys [k] = keys [k-1];
+	    known [k] = known [k-1];
+	  }
+	children [k] = i;
+	values [k] = v;
+	keys [k] = key;
+	known [k] = kept;
+	n ++;
+      }
+
+  /* No letters left to pick: the position stands as it is. */
+  if (n == 0)
+    return evaluate (state_ptr, !who, params->side);
+
+  best = maximize ? LOWEST_SCORE : HIGHEST_SCORE;
+  for (k = 0; k < n; ++k)
+    {
+      int v = values [k];
+
+      if (depth > 1 && results [children [k]].balls_in_play > 0 &&
+	  !params->aborted)
+	{
+	  state *s;
+	  int child = 0;
+
+	  TRACE_SPAN (TRACE_NODE, children [k], depth, who);
+	  s = play_child (state_ptr, who, children [k]);
+	  if (node && depth-1 >= MIN_TREE_DEPTH)
+	    child = tree_child (tree, node, children [k]);
+	  v = search_node (s, !who, depth-1, alpha, beta, params, child);
+	  free_state (s);
+	  TRACE_SPAN (TRACE_NODE_END, v, 0, 0);
+	}
+      else
+	params->nodes ++;
+
+      if (record && !params->aborted)
+	tree->nodes [node].value [children [k]] = v;
+
+      if (maximize)
+	{
+	  if (v > best) best = v;
+	  if (best > alpha) alpha = best;
+	}
+      else
+	{
+	  if (v < best) best = v;
+	  if (best < beta) beta = best;
+	}
+      if (alpha >= beta || params->aborted)
+	return best;
+    }
+
+  return best;
 }
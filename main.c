@@ -8,6 +8,13 @@
 #include <signal.h>
 #include <time.h>
 #include <malloc.h>
+#include <unistd.h>
+
+#ifdef HAVE_NCURSES
+#include <ncurses.h>
+#else
+#include <curses.h>
+#endif
 
 #include "cascade.h"
 
@@ -24,15 +31,84 @@ static int  letter_ok_and_not_picked (state *, int);
 static void picked_letter (state *, int);
 static void connect_dialog (void);
 static void end_of_game_dialog (void);
+static int  view_key (int);
+
+/* How new boards are chosen. */
+static struct board_quality board_quality;
+
+/* Where games are recorded, or NULL. */
+static struct record_store *store = NULL;
+static struct game_record record;
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+	   "usage: cascade [-c] [-s WIDTHxHEIGHT] [-b SOCKET] [-q QUALITY]\n"
+	   "               [-o DIR]\n"
+	   "where -c draws with curses, even on an ANSI terminal,\n"
+	   "-s plays on a board of that size (at least 20x15),\n"
+	   "scrolling it if it is larger than the screen, -b lets\n"
+	   "others watch with \"cascade-watch SOCKET\", -q chooses\n"
+	   "boards by \"cascade\", \"variance\" or \"none\" (the default),\n"
+	   "and -o records the games in DIR for \"cascade-query DIR\"\n");
+  exit (1);
+}
 
 int
-main (void)
+main (int argc, char *argv [])
 {
+  int c;
+
+  init_board_quality (&board_quality, QUALITY_NONE);
+
+  while ((c = getopt (argc, argv, "cs:b:q:o:")) != -1)
+    switch (c)
+      {
+      case 'c':
+	curses_only = 1;
+	break;
+      case 's':
+	if (sscanf (optarg, "%dx%d", &virtual_width, &virtual_height) != 2 ||
+	    virtual_width < 20 || virtual_height < 15)
+	  usage ();
+	break;
+      case 'b':
+	if (init_broadcast (optarg) == -1)
+	  {
+	    perror (optarg);
+	    exit (1);
+	  }
+	break;
+      case 'q':
+	if (strcmp (optarg, "none") == 0)
+	  board_quality.metric = QUALITY_NONE;
+	else if (strcmp (optarg, "cascade") == 0)
+	  board_quality.metric = QUALITY_CASCADE;
+	else if (strcmp (optarg, "variance") == 0)
+	  board_quality.metric = QUALITY_VARIANCE;
+	else
+	  usage ();
+	break;
+      case 'o':
+	store = open_record_store (optarg);
+	if (store == NULL)
+	  {
+	    perror (optarg);
+	    exit (1);
+	  }
+	break;
+      default: usage ();
+      }
+  if (optind != argc)
+    usage ();
+
   /* Initialize PRNG. */
   srand (time (NULL));
 
   /* Initialize ncurses screen library. */
   init_screen ();
+  TRACE_ONLY (start_trace ();)
 
   /* Make sure various signals are caught and handled gracefully. */
   signal (SIGINT, catch_quit);
@@ -48,6 +124,11 @@ main (void)
 
   /* Clean up & quit. */
   free_screen ();
+  free_broadcast ();
+  if (store)
+    close_record_store (store);
+  STATS_ONLY (dump_stats ();)
+  TRACE_ONLY (stop_trace ();)
   exit (0);
 }
 
@@ -104,8 +185,9 @@ connect_dialog (void)
 
 /*----------------------------------------------------------------------*/
 
-/* State of the current game. */
+/* State of the current game, and the size of its board. */
 static state *theState;
+static struct geometry geometry;
 
 static void
 play_game (void)
@@ -113,21 +195,37 @@ play_game (void)
   int who_moves = 0;
 
   layout_screen ();
+  init_geometry (&geometry, board_width, board_height);
 
   theState = init_state ();
-  generate_board_for_state (theState);
+  generate_board_for_state_seeded (theState, &geometry,
+				   choose_board_seed (&geometry, rand (),
+						      &board_quality));
 
   draw_screen (theState);
+  if (store)
+    init_game_record (&record, &geometry);
 
   /* Loop through player's and machine's goes. */
-  while (!quit && theState->balls_in_play > 0)
+  while (!quit && !game_over (theState))
     {
       play_single_move (who_moves);
       who_moves = !who_moves;
     }
 
+  if (store)
+    {
+      if (game_over (theState))
+	append_game_record (store, &record);
+      free_game_record (&record);
+    }
+
   if (!quit)
-    end_of_game_dialog ();
+    {
+      /* Don't let keys typed during the last cascade dismiss this. */
+      flush_keys ();
+      end_of_game_dialog ();
+    }
 }
 
 static void
@@ -153,13 +251,40 @@ player_moves (void)
   int letter;
 
   do {
-    letter = toupper (getkey ());
+    letter = getkey ();
+    if (view_key (letter))
+      continue;
+    letter = toupper (letter);
+#ifdef CASCADE_STATS
+    if (letter == STATS_KEY)
+      toggle_stats_hud ();
+#endif
   } while (!quit &&
 	   !letter_ok_and_not_picked (theState, letter));
 
   return letter;
 }
 
+/* The arrow and page keys scroll around a board larger than the
+ * screen. Returns true if "c" was one of them.
+ */
+static int
+view_key (int c)
+{
+  switch (c)
+    {
+    case KEY_LEFT: scroll_view (-1, 0); break;
+    case KEY_RIGHT: scroll_view (1, 0); break;
+    case KEY_UP: scroll_view (0, -1); break;
+    case KEY_DOWN: scroll_view (0, 1); break;
+    case KEY_PPAGE: scroll_view (0, -view_height/2); break;
+    case KEY_NPAGE: scroll_view (0, view_height/2); break;
+    default: return 0;
+    }
+  update_screen (theState);
+  return 1;
+}
+
 static int
 machine_moves (void)
 {
@@ -197,11 +322,19 @@ static void
 play_letter (int who_moved, int letter)
 {
   /* Remove all instances of this letter from the board. */
-  remove_letter_from_board (theState->board, letter);
+  remove_letter_from_board (&theState->geom, theState->board, letter);
   update_screen (theState);
 
-  /* Let the balls fall. */
+  /* Let the balls fall. If a key was pressed to skip the animation,
+   * show where they ended up.
+   */
+  if (store)
+    begin_move_record (&record, theState);
   drop_balls (theState->board, theState, who_moved, 1);
+  if (store)
+    end_move_record (&record, theState, who_moved, letter);
+  end_animation ();
+  update_screen (theState);
 }
 
 static void
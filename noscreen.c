@@ -0,0 +1,43 @@
+/* Cascade (C) 1997 Richard W.M. Jones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cascade.h"
+
+/* Stand-ins for the display functions which the game engine calls,
+ * for headless programs which are linked without screen.c or curses.
+ * They never draw anything, since such programs always simulate with
+ * "need_update" false.
+ */
+
+void
+update_screen (state *s)
+{
+}
+
+void
+rolling_ball_animation (state *state_ptr, int i, int j, int who_moved)
+{
+}
+
+void
+follow_ball (int i, int j)
+{
+}
+
+void
+scroll_view (int dx, int dy)
+{
+}
+
+int
+animation_wanted (void)
+{
+  return 0;
+}
+
+void
+free_screen (void)
+{
+}
@@ -0,0 +1,222 @@
+/* Cascade (C) 1997 Richard W.M. Jones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cascade.h"
+
+/* Queries over a store of game records (see records.c), eg. made by
+ * "tournament -o DIR". Each query scans just the columns it needs,
+ * straight from the mapped files, and the index of games is used to
+ * find the moves of one game, or the start of each game.
+ */
+
+volatile int quit = 0;
+
+static struct record_columns rc;
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+	   "usage: cascade-query DIR [QUERY]\n"
+	   "where QUERY is one of\n"
+	   "  summary              count the games and moves (the default)\n"
+	   "  letters [FROM [TO]]  points won by each letter, over the moves\n"
+	   "                       numbered FROM to TO (from 0) in each game\n"
+	   "  flags                points won by moves made with each of the\n"
+	   "                       flags set\n"
+	   "  game N               the moves of game number N (from 0)\n"
+	   "  seed SEED            the moves of the games on board SEED\n");
+  exit (1);
+}
+
+/* The points won by the side which moved, less those it gave away. */
+static inline int
+net_points (long r)
+{
+  int d = rc.pdelta [r] - rc.mdelta [r];
+
+  return rc.who [r] == 0 ? d : -d;
+}
+
+static long
+game_end (long g)
+{
+  return g+1 < rc.nr_games ? rc.games [g+1] : rc.nr_rows;
+}
+
+static void
+summary (void)
+{
+  long r, points = 0, cascade = 0, both = 0;
+
+  for (r = 0; r < rc.nr_rows; ++r)
+    {
+      points += rc.pdelta [r] + rc.mdelta [r];
+      cascade += rc.cascade [r];
+      both += rc.negate [r] && rc.dooble [r];
+    }
+  printf ("games        %ld\n", rc.nr_games);
+  printf ("moves        %ld\n", rc.nr_rows);
+  if (rc.nr_rows == 0)
+    return;
+  printf ("points/move  %.3f\n", (double) points / rc.nr_rows);
+  printf ("cascade/move %.1f cells\n", (double) cascade / rc.nr_rows);
+  printf ("both flags   %.2f%% of moves leave them set\n",
+	  100.0 * both / rc.nr_rows);
+}
+
+struct letter_stats {
+  int letter;
+  long moves, points, wins, cascade;
+};
+
+static int
+compare_letter_stats (const void *v1, const void *v2)
+{
+  const struct letter_stats *a = v1, *b = v2;
+  double ma = a->moves ? (double) a->points / a->moves : -1e9;
+  double mb = b->moves ? (double) b->points / b->moves : -1e9;
+
+  return ma < mb ? 1 : ma > mb ? -1 : a->letter - b->letter;
+}
+
+static void
+letter_query (int from, int to)
+{
+  struct letter_stats ls [BD_NR_LETTERS];
+  long r;
+  int i;
+
+  memset (ls, 0, sizeof ls);
+  for (i = 0; i < BD_NR_LETTERS; ++i)
+    ls [i].letter = i;
+
+  for (r = 0; r < rc.nr_rows; ++r)
+    if (from <= rc.move [r] && rc.move [r] <= to)
+      {
+	struct letter_stats *l = &ls [rc.letter [r] % BD_NR_LETTERS];
+	int p = net_points (r);
+
+	l->moves ++;
+	l->points += p;
+	l->wins += p > 0;
+	l->cascade += rc.cascade [r];
+      }
+
+  qsort (ls, BD_NR_LETTERS, sizeof ls [0], compare_letter_stats);
+  printf ("%-6s %10s  %11s  %6s  %8s\n",
+	  "letter", "moves", "points/move", "won", "cascade");
+  for (i = 0; i < BD_NR_LETTERS; ++i)
+    if (ls [i].moves > 0)
+      printf ("%-6c %10ld  %+11.3f  %5.1f%%  %8.1f\n",
+	      letters [ls [i].letter], ls [i].moves,
+	      (double) ls [i].points / ls [i].moves,
+	      100.0 * ls [i].wins / ls [i].moves,
+	      (double) ls [i].cascade / ls [i].moves);
+}
+
+/* Moves are grouped by the flags left set by the move before, which
+ * count against the side to move: so the "both" line shows how well
+ * leaving both flags set pays off, from the other side's point of view.
+ */
+static void
+flag_query (void)
+{
+  static const char *names [4] = { "none", "negate", "double", "both" };
+  long moves [4] = { 0 }, points [4] = { 0 }, wins [4] = { 0 };
+  long g, r;
+  int f;
+
+  for (g = 0; g < rc.nr_games; ++g)
+    {
+      long end = game_end (g);
+
+      f = 0;
+      for (r = rc.games [g]; r < end; ++r)
+	{
+	  int p = net_points (r);
+
+	  moves [f] ++;
+	  points [f] += p;
+	  wins [f] += p > 0;
+	  f = (rc.negate [r] != 0) | (rc.dooble [r] != 0) << 1;
+	}
+    }
+
+  printf ("%-9s %10s  %11s  %6s\n", "flags set", "moves", "points/move", "won");
+  for (f = 0; f < 4; ++f)
+    if (moves [f] > 0)
+      printf ("%-9s %10ld  %+11.3f  %5.1f%%\n", names [f], moves [f],
+	      (double) points [f] / moves [f], 100.0 * wins [f] / moves [f]);
+}
+
+static void
+show_game (long g)
+{
+  long r, end = game_end (g);
+
+  printf ("game %ld, seed %u\n", g, rc.seed [rc.games [g]]);
+  printf ("%4s  %-7s  %6s  %6s  %7s  %5s  %7s\n",
+	  "move", "who", "letter", "player", "machine", "flags", "cascade");
+  for (r = rc.games [g]; r < end; ++r)
+    printf ("%4d  %-7s  %6c  %+6d  %+7d     %c%c  %7d\n",
+	    rc.move [r], rc.who [r] ? "machine" : "player",
+	    letters [rc.letter [r] % BD_NR_LETTERS],
+	    rc.pdelta [r], rc.mdelta [r],
+	    rc.negate [r] ? 'N' : '-', rc.dooble [r] ? 'D' : '-',
+	    rc.cascade [r]);
+}
+
+int
+main (int argc, char *argv [])
+{
+  const char *query;
+
+  if (argc < 2)
+    usage ();
+  if (map_record_columns (argv [1], &rc) == -1)
+    {
+      perror (argv [1]);
+      exit (1);
+    }
+
+  query = argc > 2 ? argv [2] : "summary";
+  if (strcmp (query, "summary") == 0 && argc <= 3)
+    summary ();
+  else if (strcmp (query, "letters") == 0 && argc <= 5)
+    letter_query (argc > 3 ? atoi (argv [3]) : 0,
+		  argc > 4 ? atoi (argv [4]) : BD_NR_LETTERS);
+  else if (strcmp (query, "flags") == 0 && argc == 3)
+    flag_query ();
+  else if (strcmp (query, "game") == 0 && argc == 4)
+    {
+      long g = atol (argv [3]);
+
+      if (g < 0 || g >= rc.nr_games)
+	fatal ("no such game");
+      show_game (g);
+    }
+  else if (strcmp (query, "seed") == 0 && argc == 4)
+    {
+      unsigned int seed = strtoul (argv [3], NULL, 0);
+      long g, found = 0;
+
+      for (g = 0; g < rc.nr_games; ++g)
+	if (rc.seed [rc.games [g]] == seed)
+	  {
+	    if (found++)
+	      printf ("\n");
+	    show_game (g);
+	  }
+      if (!found)
+	fatal ("no games on that board");
+    }
+  else
+    usage ();
+
+  unmap_record_columns (&rc);
+  exit (0);
+}
@@ -0,0 +1,333 @@
+/* Cascade (C) 1997 Richard W.M. Jones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "cascade.h"
+
+/* Records of games played, for mining many games for statistics (see
+ * query.c). A store is a directory with one file per column of the
+ * moves (COLUMN.col), each a plain array, and an index of the games,
+ * games.col, which holds the first row of each game. So a query reads
+ * only the columns it needs, straight from the mapped files.
+ *
+ * Whole games are appended at once, under a lock, so one store can be
+ * shared by the threads of a tournament. The files are appended to
+ * separately, so a store which was not closed properly can have
+ * columns of different lengths: the shortest one counts, and the
+ * others are cut down to it when the store is next opened.
+ */
+
+struct column {
+  const char *name;
+  int width;			/* Bytes per row. */
+  size_t field;			/* Offset in struct move_record. */
+};
+
+static const struct column columns [] = {
+  { "seed", 4, offsetof (struct move_record, seed) },
+  { "move", 1, offsetof (struct move_record, move) },
+  { "letter", 1, offsetof (struct move_record, letter) },
+  { "who", 1, offsetof (struct move_record, who) },
+  { "negate", 1, offsetof (struct move_record, negate) },
+  { "double", 1, offsetof (struct move_record, dooble) },
+  { "pdelta", 4, offsetof (struct move_record, pdelta) },
+  { "mdelta", 4, offsetof (struct move_record, mdelta) },
+  { "cascade", 4, offsetof (struct move_record, cascade) },
+};
+#define NR_COLUMNS (sizeof columns / sizeof columns [0])
+#define GAMES NR_COLUMNS		/* Number of the index file. */
+
+struct record_store {
+  pthread_mutex_t lock;
+  FILE *fp [RECORD_FILES];
+  long nr_rows;
+};
+
+void
+init_game_record (struct game_record *r, const struct geometry *g)
+{
+  r->nr_moves = 0;
+  r->before = malloc (g->width * g->height);
+  if (r->before == NULL)
+    fatal_perror ("malloc");
+}
+
+void
+free_game_record (struct game_record *r)
+{
+  free (r->before);
+}
+
+/* Call after the letter has been removed, before the balls fall. */
+void
+begin_move_record (struct game_record *r, const state *s)
+{
+  r->before_rows = s->rows_ready;
+  memcpy (r->before, s->board, s->geom.width * s->rows_ready);
+  r->pscore = s->pscore;
+  r->mscore = s->mscore;
+}
+
+/* Call after the balls have fallen. */
+void
+end_move_record (struct game_record *r, const state *s, int who, int letter)
+{
+  struct move_record *m = &r->moves [r->nr_moves++];
+  long c, nr_cells = (long) s->geom.width * s->rows_ready;
+
+  assert (r->nr_moves <= BD_NR_LETTERS);
+
+  /* Rows made while the balls fell were made with the letter gone. */
+  if (s->rows_ready > r->before_rows)
+    generate_board_rows (&s->geom, r->before, s->seed, s->picked,
+			 r->before_rows, s->rows_ready);
+
+  m->seed = s->seed;
+  m->move = r->nr_moves - 1;
+  m->letter = strchr (letters, letter) - letters;
+  m->who = who;
+  m->negate = s->negate;
+  m->dooble = s->dooble;
+  m->pdelta = s->pscore - r->pscore;
+  m->mdelta = s->mscore - r->mscore;
+  m->cascade = 0;
+  for (c = 0; c < nr_cells; ++c)
+    m->cascade += r->before [c] != s->board [c];
+}
+
+static char *
+column_path (const char *dir, int i)
+{
+  const char *name = i == GAMES ? "games" : columns [i].name;
+  char *path = malloc (strlen (dir) + strlen (name) + 6);
+
+  if (path == NULL)
+    fatal_perror ("malloc");
+  sprintf (path, "%s/%s.col", dir, name);
+  return path;
+}
+
+static int
+column_width (int i)
+{
+  return i == GAMES ? sizeof (long) : columns [i].width;
+}
+
+/* Open the store in "dir" to append to, making it if need be.
+ * Returns NULL, with errno set, if it cannot be opened.
+ */
+struct record_store *
+open_record_store (const char *dir)
+{
+  struct record_store *store;
+  int fd [RECORD_FILES];
+  off_t size [RECORD_FILES];
+  long nr_games;
+  int i, j;
+
+  if (mkdir (dir, 0777) == -1 && errno != EEXIST)
+    return NULL;
+
+  for (i = 0; i < RECORD_FILES; ++i)
+    {
+      char *path = column_path (dir, i);
+      struct stat st;
+
+      fd [i] = open (path, O_RDWR | O_CREAT | O_APPEND, 0666);
+      free (path);
+      if (fd [i] == -1 || fstat (fd [i], &st) == -1)
+	{
+	  int e = errno;
+
+	  for (j = 0; j <= i; ++j)
+	    if (fd [j] != -1)
+	      close (fd [j]);
+	  errno = e;
+	  return NULL;
+	}
+      size [i] = st.st_size;
+    }
+
+  store = malloc (sizeof (struct record_store));
+  if (store == NULL)
+    fatal_perror ("malloc");
+  pthread_mutex_init (&store->lock, NULL);
+
+  /* Cut off anything left over from a store not closed properly. */
+  store->nr_rows = size [0] / column_width (0);
+  for (i = 1; i < NR_COLUMNS; ++i)
+    if (size [i] / column_width (i) < store->nr_rows)
+      store->nr_rows = size [i] / column_width (i);
+  nr_games = size [GAMES] / column_width (GAMES);
+  while (nr_games > 0)
+    {
+      long first;
+
+      if (pread (fd [GAMES], &first, sizeof first,
+		 (nr_games-1) * sizeof first) == sizeof first &&
+	  first < store->nr_rows)
+	break;
+      nr_games --;
+    }
+
+  for (i = 0; i < RECORD_FILES; ++i)
+    {
+      off_t want = i == GAMES ? nr_games * column_width (i)
+	: store->nr_rows * column_width (i);
+
+      if (size [i] != want && ftruncate (fd [i], want) == -1)
+	{
+	  int e = errno;
+
+	  for (j = 0; j < RECORD_FILES; ++j)
+	    close (fd [j]);
+	  pthread_mutex_destroy (&store->lock);
+	  free (store);
+	  errno = e;
+	  return NULL;
+	}
+    }
+
+  for (i = 0; i < RECORD_FILES; ++i)
+    {
+      store->fp [i] = fdopen (fd [i], "a");
+      if (store->fp [i] == NULL)
+	fatal_perror ("fdopen");
+    }
+  return store;
+}
+
+/* Append the moves of game "r" to the store, and empty "r" for the
+ * next game.
+ */
+void
+append_game_record (struct record_store *store, struct game_record *r)
+{
+  unsigned char buf [BD_NR_LETTERS * 4];
+  int i, k;
+
+  if (r->nr_moves == 0)
+    return;
+
+  pthread_mutex_lock (&store->lock);
+  if (fwrite (&store->nr_rows, sizeof (long), 1, store->fp [GAMES]) != 1)
+    fatal_perror ("games.col");
+  for (i = 0; i < NR_COLUMNS; ++i)
+    {
+      int w = columns [i].width;
+
+      for (k = 0; k < r->nr_moves; ++k)
+	memcpy (buf + k * w, (char *) &r->moves [k] + columns [i].field, w);
+      if (fwrite (buf, w, r->nr_moves, store->fp [i]) != r->nr_moves)
+	fatal_perror (columns [i].name);
+    }
+  store->nr_rows += r->nr_moves;
+  pthread_mutex_unlock (&store->lock);
+
+  r->nr_moves = 0;
+}
+
+void
+close_record_store (struct record_store *store)
+{
+  int i;
+
+  for (i = 0; i < RECORD_FILES; ++i)
+    if (fclose (store->fp [i]) == EOF)
+      perror (i == GAMES ? "games.col" : columns [i].name);
+  pthread_mutex_destroy (&store->lock);
+  free (store);
+}
+
+/* Map the store in "dir" for reading. Returns -1, with errno set, if
+ * it cannot be read.
+ */
+int
+map_record_columns (const char *dir, struct record_columns *rc)
+{
+  const void *p [RECORD_FILES];
+  int i;
+
+  memset (rc, 0, sizeof (struct record_columns));
+  for (i = 0; i < RECORD_FILES; ++i)
+    {
+      char *path = column_path (dir, i);
+      int fd = open (path, O_RDONLY);
+      struct stat st;
+      long rows;
+
+      free (path);
+      if (fd == -1 || fstat (fd, &st) == -1)
+	{
+	  int e = errno;
+
+	  if (fd != -1)
+	    close (fd);
+	  unmap_record_columns (rc);
+	  errno = e;
+	  return -1;
+	}
+      if (st.st_size > 0)
+	{
+	  rc->maps [i] = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	  if (rc->maps [i] == MAP_FAILED)
+	    {
+	      int e = errno;
+
+	      rc->maps [i] = NULL;
+	      close (fd);
+	      unmap_record_columns (rc);
+	      errno = e;
+	      return -1;
+	    }
+	  rc->sizes [i] = st.st_size;
+	  madvise (rc->maps [i], st.st_size, MADV_SEQUENTIAL);
+	}
+      close (fd);
+      p [i] = rc->maps [i];
+
+      rows = st.st_size / column_width (i);
+      if (i == GAMES)
+	rc->nr_games = rows;
+      else if (i == 0 || rows < rc->nr_rows)
+	rc->nr_rows = rows;
+    }
+
+  rc->seed = p [0];
+  rc->move = p [1];
+  rc->letter = p [2];
+  rc->who = p [3];
+  rc->negate = p [4];
+  rc->dooble = p [5];
+  rc->pdelta = p [6];
+  rc->mdelta = p [7];
+  rc->cascade = p [8];
+  rc->games = p [GAMES];
+
+  /* Games still being written when the files were mapped. */
+  while (rc->nr_games > 0 && rc->games [rc->nr_games-1] >= rc->nr_rows)
+    rc->nr_games --;
+  return 0;
+}
+
+void
+unmap_record_columns (struct record_columns *rc)
+{
+  int i;
+
+  for (i = 0; i < RECORD_FILES; ++i)
+    if (rc->maps [i] != NULL)
+      munmap (rc->maps [i], rc->sizes [i]);
+  memset (rc, 0, sizeof (struct record_columns));
+}
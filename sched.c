@@ -0,0 +1,298 @@
+/* Cascade (C) 1997 Richard W.M. Jones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "cascade.h"
+
+/* Scheduler for machine moves, for a process which hosts many games
+ * at once. Searches run on a fixed pool of worker threads. Jobs wait
+ * in a short priority queue, shallowest search first and then
+ * earliest deadline first. When the pool is overloaded, new jobs are
+ * searched less deeply instead of being allowed to pile up: a job
+ * which arrives to find others already waiting loses two plies for
+ * each worker's worth of waiting jobs, and a job which arrives to find
+ * the queue full is answered at once, at depth 1, by the caller's own
+ * thread. Only the depth is cut: a level which passes over its best
+ * moves (its "omit") still does so.
+ */
+
+struct job {
+  state *state_ptr;		/* Private copy of the position. */
+  struct search_params params;
+  double submitted;		/* Time the job was queued. */
+  scheduler_callback callback;
+  void *opaque;
+};
+
+struct scheduler {
+  pthread_mutex_t lock;
+  pthread_cond_t work;		/* Signalled when a job is queued. */
+  int stopping;			/* Set when the scheduler is being freed. */
+
+  int nr_workers;
+  pthread_t *workers;
+
+  int max_queued;		/* Size of the queue. */
+  int nr_queued;		/* Jobs in the queue. */
+  struct job *queue;		/* Heap, most urgent job at the top. */
+
+  struct scheduler_metrics metrics;
+};
+
+static void *worker (void *);
+static void run_job (struct scheduler *, struct job *);
+
+struct scheduler *
+init_scheduler (int nr_workers, int max_queued)
+{
+  struct scheduler *sched;
+  int i;
+
+  assert (nr_workers >= 1);
+  assert (max_queued >= 1);
+
+  sched = malloc (sizeof (struct scheduler));
+  if (sched == NULL)
+    fatal_perror ("malloc");
+  memset (sched, 0, sizeof (struct scheduler));
+
+  pthread_mutex_init (&sched->lock, NULL);
+  pthread_cond_init (&sched->work, NULL);
+
+  sched->max_queued = max_queued;
+  sched->queue = malloc (max_queued * sizeof (struct job));
+  if (sched->queue == NULL)
+    fatal_perror ("malloc");
+
+  sched->nr_workers = nr_workers;
+  sched->workers = malloc (nr_workers * sizeof (pthread_t));
+  if (sched->workers == NULL)
+    fatal_perror ("malloc");
+  for (i = 0; i < nr_workers; ++i)
+    if (pthread_create (&sched->workers [i], NULL, worker, sched) != 0)
+      fatal ("cannot create scheduler worker thread");
+
+  return sched;
+}
+
+/* Wait for the queued jobs to finish, then stop the workers. */
+void
+free_scheduler (struct scheduler *sched)
+{
+  int i;
+
+  pthread_mutex_lock (&sched->lock);
+  sched->stopping = 1;
+  pthread_cond_broadcast (&sched->work);
+  pthread_mutex_unlock (&sched->lock);
+
+  for (i = 0; i < sched->nr_workers; ++i)
+    pthread_join (sched->workers [i], NULL);
+
+  pthread_cond_destroy (&sched->work);
+  pthread_mutex_destroy (&sched->lock);
+  free (sched->workers);
+  free (sched->queue);
+  free (sched);
+}
+
+void
+get_scheduler_metrics (struct scheduler *sched,
+		       struct scheduler_metrics *metrics_rtn)
+{
+  pthread_mutex_lock (&sched->lock);
+  *metrics_rtn = sched->metrics;
+  pthread_mutex_unlock (&sched->lock);
+}
+
+/* Returns true if job "a" should run before job "b". Jobs with no
+ * deadline come last.
+ */
+static inline int
+more_urgent (const struct job *a, const struct job *b)
+{
+  if (a->params.ply != b->params.ply)
+    return a->params.ply < b->params.ply;
+  if (a->params.deadline == 0 || b->params.deadline == 0)
+    return b->params.deadline == 0 && a->params.deadline != 0;
+  return a->params.deadline < b->params.deadline;
+}
+
+static void
+push_job (struct scheduler *sched, const struct job *job)
+{
+  int i = sched->nr_queued++;
+
+  assert (sched->nr_queued <= sched->max_queued);
+
+  while (i > 0 && more_urgent (job, &sched->queue [(i-1)/2]))
+    {
+      sched->queue [i] = sched->queue [(i-1)/2];
+      i = (i-1)/2;
+    }
+  sched->queue [i] = *job;
+}
+
+static void
+pop_job (struct scheduler *sched, struct job *job_rtn)
+{
+  struct job last;
+  int i = 0, child;
+
+  assert (sched->nr_queued > 0);
+
+  *job_rtn = sched->queue [0];
+  last = sched->queue [--sched->nr_queued];
+
+  while ((child = 2*i+1) < sched->nr_queued)
+    {
+      if (child+1 < sched->nr_queued &&
+	  more_urgent (&sched->queue [child+1], &sched->queue [child]))
+	child ++;
+      if (!more_urgent (&sched->queue [child], &last))
+	break;
+      sched->queue [i] = sched->queue [child];
+      i = child;
+    }
+  sched->queue [i] = last;
+}
+
+/* Ask for a machine move in the position "state_ptr", searched with
+ * the parameters "params" (see init_search_params), which are copied.
+ * If the deadline is set, the move should be ready by then. The
+ * position is copied too, so the caller may carry on with it. Later,
+ * "callback" is called from a worker thread with "opaque", the letter
+ * chosen and the search results. If the scheduler is saturated, the
+ * callback is called before this function returns. The tree in
+ * "params", if any, must not be used again until then.
+ */
+void
+schedule_machine_move (struct scheduler *sched, const state *state_ptr,
+		       const struct search_params *params,
+		       scheduler_callback callback, void *opaque)
+{
+  struct job job;
+  int waiting, degraded = 0;
+
+  job.submitted = current_time ();
+  job.params = *params;
+  job.callback = callback;
+  job.opaque = opaque;
+
+  pthread_mutex_lock (&sched->lock);
+
+  sched->metrics.submitted ++;
+  waiting = sched->nr_queued;
+
+  if (waiting >= sched->max_queued)
+    {
+      /* Shed the load: a depth 1 search here and now, keeping the
+       * level's omits.
+       */
+      sched->metrics.shed ++;
+      if (job.params.ply > 1)
+	sched->metrics.degraded ++;
+      pthread_mutex_unlock (&sched->lock);
+
+      job.params.ply = 1;
+      job.state_ptr = (state *) state_ptr;
+      run_job (sched, &job);
+      return;
+    }
+
+  if (waiting > 0 && job.params.ply > 1)
+    {
+      int cut = 2 * ((waiting + sched->nr_workers - 1) / sched->nr_workers);
+
+      job.params.ply = job.params.ply - cut >= 1 ? job.params.ply - cut : 1;
+      sched->metrics.degraded ++;
+      degraded = 1;
+    }
+
+  pthread_mutex_unlock (&sched->lock);
+
+  /* Copy the position outside the lock. */
+  job.state_ptr = copy_state (state_ptr);
+
+  pthread_mutex_lock (&sched->lock);
+  if (sched->nr_queued >= sched->max_queued)
+    {
+      /* The queue filled up while we were copying. */
+      sched->metrics.shed ++;
+      if (job.params.ply > 1 && !degraded)
+	sched->metrics.degraded ++;
+      pthread_mutex_unlock (&sched->lock);
+
+      job.params.ply = 1;
+      run_job (sched, &job);
+      free_state (job.state_ptr);
+      return;
+    }
+  push_job (sched, &job);
+  if (sched->nr_queued > sched->metrics.max_queue_depth)
+    sched->metrics.max_queue_depth = sched->nr_queued;
+  sched->metrics.queue_depth = sched->nr_queued;
+  pthread_cond_signal (&sched->work);
+  pthread_mutex_unlock (&sched->lock);
+}
+
+/* Search for the move, account for it, and hand it back. */
+static void
+run_job (struct scheduler *sched, struct job *job)
+{
+  double started = current_time ();
+  double wait = started - job->submitted;
+  double elapsed;
+  int letter;
+
+  letter = search_machine_move (job->state_ptr, &job->params);
+  elapsed = current_time () - started;
+
+  pthread_mutex_lock (&sched->lock);
+  sched->metrics.completed ++;
+  sched->metrics.total_wait += wait;
+  if (wait > sched->metrics.max_wait)
+    sched->metrics.max_wait = wait;
+  sched->metrics.total_search += elapsed;
+  if (elapsed > sched->metrics.max_search)
+    sched->metrics.max_search = elapsed;
+  if (job->params.deadline > 0 && current_time () > job->params.deadline)
+    sched->metrics.late ++;
+  pthread_mutex_unlock (&sched->lock);
+
+  job->callback (job->opaque, letter, &job->params);
+}
+
+static void *
+worker (void *vp)
+{
+  struct scheduler *sched = (struct scheduler *) vp;
+  struct job job;
+
+  pthread_mutex_lock (&sched->lock);
+  for (;;)
+    {
+      while (sched->nr_queued == 0 && !sched->stopping)
+	pthread_cond_wait (&sched->work, &sched->lock);
+      if (sched->nr_queued == 0)
+	break;
+
+      pop_job (sched, &job);
+      sched->metrics.queue_depth = sched->nr_queued;
+      sched->metrics.busy_workers ++;
+      pthread_mutex_unlock (&sched->lock);
+
+      run_job (sched, &job);
+      free_state (job.state_ptr);
+
+      pthread_mutex_lock (&sched->lock);
+      sched->metrics.busy_workers --;
+    }
+  pthread_mutex_unlock (&sched->lock);
+
+  return NULL;
+}
@@ -12,6 +12,12 @@
 #endif
 #include <assert.h>
 
+#ifdef CASCADE_STATS
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
 #include "cascade.h"
 
 /* Code to handle the display. */
@@ -26,13 +32,31 @@ int score_width;		/* Width of scores. */
 int floor_x, floor_y;		/* Location of "floor". */
 int board_x, board_y;		/* Location of playing board. */
 int board_width, board_height;	/* Size of the playing board. */
+int virtual_width, virtual_height; /* Board size asked for, or 0. */
+int view_width, view_height;	/* Size of the part of board shown. */
+int view_left, view_top;	/* Board cell at top left of the view. */
 int roll_y;			/* Line where balls roll along. */
 int roll_x_min, roll_x_max;	/* Stop points for rolling balls. */
+int curses_only = 0;		/* Draw with curses even on ANSI terminals. */
+
+/* Set when drawing with ansi.c rather than curses. Curses is still
+ * used for the keyboard, and its own screen is left blank, so that
+ * it never writes over what ansi.c has drawn.
+ */
+static int ansi_screen = 0;
+static int colors_ready = 0;	/* Set when the colour pairs are set up. */
 
 /* Curses tags for various attributes. */
 #define REVERSE A_REVERSE
 #define BOLD A_BOLD
 
+/* Count a call into curses in the performance counters. */
+#ifdef CASCADE_STATS
+#define CURSES_CALL(call) (STATS_ADD (curses_calls, 1), (call))
+#else
+#define CURSES_CALL(call) (call)
+#endif
+
 void
 layout_screen (void)
 {
@@ -59,13 +83,49 @@ layout_screen (void)
   negf_y = pscore_y - 3; negf_x = 0;
   dblf_y = pscore_y - 5; dblf_x = negf_x;
 
-  /* Decide on the size of the board. */
-  board_width = width - 20;
-  board_height = height - 5;
+  /* Decide on the size of the board. It fits the screen unless some
+   * other size was asked for, in which case as much of it as fits is
+   * shown, and the view scrolls around the board.
+   */
+  view_width = width - 20;
+  view_height = height - 5;
+  board_width = virtual_width > 0 ? virtual_width : view_width;
+  board_height = virtual_height > 0 ? virtual_height : view_height;
+  if (view_width > board_width) view_width = board_width;
+  if (view_height > board_height) view_height = board_height;
+  view_left = view_top = 0;
 
   /* Put the board in the centre of the screen. */
   board_y = 2;
-  board_x = (width - board_width)/2;
+  board_x = (width - view_width)/2;
+}
+
+/* Move the view by (dx,dy) cells, keeping it on the board. */
+void
+scroll_view (int dx, int dy)
+{
+  view_left += dx;
+  view_top += dy;
+  if (view_left > board_width - view_width)
+    view_left = board_width - view_width;
+  if (view_left < 0)
+    view_left = 0;
+  if (view_top > board_height - view_height)
+    view_top = board_height - view_height;
+  if (view_top < 0)
+    view_top = 0;
+}
+
+/* Scroll the view so that the ball at (i,j) is well inside it. */
+void
+follow_ball (int i, int j)
+{
+  int mx = view_width / 4, my = view_height / 4;
+
+  if (i < view_left + mx || i >= view_left + view_width - mx)
+    scroll_view (i - view_left - view_width / 2, 0);
+  if (j < view_top + my || j >= view_top + view_height - my)
+    scroll_view (0, j - view_top - view_height / 2);
 }
 
 static char *
@@ -87,93 +147,354 @@ string (int c, int n)
   return s;
 }
 
+/* Everything is drawn with put_cell and put_string, and shown on the
+ * terminal by flush_screen, using either ansi.c or curses.
+ */
+
+static void
+init_colors (void)
+{
+  start_color ();
+  init_pair (1, COLOR_GREEN, COLOR_BLACK);  // $$$ (Bonus)
+  init_pair (2, COLOR_CYAN, COLOR_BLACK);   // *** (Double)
+  init_pair (3, COLOR_RED, COLOR_BLACK);    // --- (Negate)
+  init_pair (4, COLOR_YELLOW, COLOR_BLACK); // The balls 'o'
+  colors_ready = 1;
+}
+
+static inline int
+curses_attrs (int cell)
+{
+  int attrs = 0;
+
+  if (cell & CELL_BOLD)
+    attrs |= BOLD;
+  if (cell & CELL_REVERSE)
+    attrs |= REVERSE;
+  if (CELL_PAIR (cell))
+    attrs |= COLOR_PAIR (CELL_PAIR (cell));
+  return attrs;
+}
+
+static inline void
+put_cell (int y, int x, int cell)
+{
+  if (ansi_screen)
+    put_ansi_cell (y, x, cell);
+  else
+    {
+      int attrs = curses_attrs (cell);
+
+      if (attrs)
+	CURSES_CALL (attron (attrs));
+      CURSES_CALL (mvaddch (y, x, cell & 0xff));
+      if (attrs)
+	CURSES_CALL (attroff (attrs));
+    }
+}
+
+/* Write "s" at (y,x), with the CELL_* attributes "attrs". */
+static void
+put_string (int y, int x, const char *s, int attrs)
+{
+  if (ansi_screen)
+    for (; *s; ++s, ++x)
+      put_ansi_cell (y, x, (unsigned char) *s | attrs);
+  else
+    {
+      attrs = curses_attrs (attrs);
+      if (attrs)
+	CURSES_CALL (attron (attrs));
+      CURSES_CALL (mvaddstr (y, x, s));
+      if (attrs)
+	CURSES_CALL (attroff (attrs));
+    }
+}
+
+/* Show what has been drawn. */
+void
+flush_screen (void)
+{
+  if (ansi_screen)
+    flush_ansi ();
+  else
+    {
+      setsyx (0, 0);
+      CURSES_CALL (refresh ());
+    }
+}
+
+/* Draw with ansi.c, writing to "fd". */
+void
+start_ansi_screen (int fd)
+{
+  init_ansi (fd, width, height);
+  ansi_screen = 1;
+}
+
+void
+stop_ansi_screen (void)
+{
+  free_ansi ();
+  ansi_screen = 0;
+}
+
+/* Returns true if the terminal moves its cursor with the ANSI escape
+ * sequence, and so (we assume) understands the rest of them too.
+ */
+static int
+ansi_terminal (void)
+{
+  const char *cup = tigetstr ("cup");
+
+  return cup != NULL && cup != (char *) -1 &&
+    strncmp (cup, "\033[", 2) == 0 && has_colors ();
+}
+
 void
 draw_screen (state *s)
 {
   /* Clear the screen. */
-  clear ();
-
-  attron (BOLD);
+  clear_screen ();
 
   /* Draw the floor. */
-  mvaddstr (floor_y, floor_x, string ('=', width));
+  put_string (floor_y, floor_x, string ('=', width), CELL_BOLD);
 
   /* Draw the keys. */
-  mvaddstr (keys_y, keys_x, "Keys: ...");
+  put_string (keys_y, keys_x, "Keys: ...", CELL_BOLD);
 
-  attroff (BOLD);
+  /* Spectators need the whole board again. */
+  restart_broadcast ();
 
   /* Draw the rest of the stuff. */
   update_screen (s);
 }
 
-static inline void
-display_board_char (char c)
+/* How each thing on the board is drawn. */
+static const int board_cells [] = {
+  ' ',				/* BD_EMPTY */
+  '|' | CELL_REVERSE,		/* BD_WALL */
+  ' ' | CELL_REVERSE,		/* BD_BRICK */
+  'o' | CELL_BOLD | CELL_COLOR (4), /* BD_BALL */
+  '-' | CELL_BOLD | CELL_COLOR (3), /* BD_NEGATE */
+  '*' | CELL_BOLD | CELL_COLOR (2), /* BD_DOUBLE */
+  '$' | CELL_BOLD | CELL_COLOR (1), /* BD_HEART */
+};
+
+static inline int
+board_cell (char c)
+{
+  return c <= BD_HEART ? board_cells [(int) c] : (unsigned char) c;
+}
+
+#ifdef CASCADE_STATS
+
+static int show_stats = 0;	/* Set when the counters are on screen. */
+
+static void
+draw_keys_banner (void)
 {
-  start_color();
-  init_pair(1, COLOR_GREEN, COLOR_BLACK);  // $$$ (Bonus)
-  init_pair(2, COLOR_CYAN, COLOR_BLACK);   // *** (Double)
-  init_pair(3, COLOR_RED, COLOR_BLACK);    // --- (Negate)
-  init_pair(4, COLOR_YELLOW, COLOR_BLACK); // The balls 'o'
+  char buffer [256];
+  int n = width < sizeof buffer ? width+1 : sizeof buffer;
 
-  switch (c)
+  put_string (keys_y, keys_x, string (' ', width), CELL_BOLD);
+  if (show_stats)
     {
-    case BD_EMPTY: addch (' ');
-      break;
-    case BD_WALL:  attron (REVERSE); addch ('|'); attroff (REVERSE);
-      break;
-    case BD_BRICK: attron (REVERSE); addch (' '); attroff (REVERSE);
-      break;
-    case BD_BALL:  attron (BOLD); attron(COLOR_PAIR(4)); addch ('o'); attroff (BOLD); attroff(COLOR_PAIR(4));
-      break;
-    case BD_NEGATE:attron (BOLD); attron(COLOR_PAIR(3)); addch ('-'); attroff (BOLD); attroff(COLOR_PAIR(3));
-      break;
-    case BD_DOUBLE:attron (BOLD); attron(COLOR_PAIR(2)); addch ('*'); attroff (BOLD); attroff(COLOR_PAIR(2));
-      break;
-    case BD_HEART: attron (BOLD); attron(COLOR_PAIR(1)); addch ('$'); attroff (BOLD); attroff(COLOR_PAIR(1));
-      break;
-    default:
-      addch (c);
+      format_stats_hud (buffer, n);
+      put_string (keys_y, keys_x, buffer, CELL_BOLD);
     }
+  else
+    put_string (keys_y, keys_x, "Keys: ...", CELL_BOLD);
+}
+
+/* Count the bytes sent to the terminal, by passing standard output
+ * through a pipe to a thread which counts them on their way. Curses
+ * sets the terminal modes and finds its size on standard error when
+ * standard output is not a terminal, so nothing else changes. (Only
+ * when both are the terminal: otherwise the bytes are not counted.)
+ */
+static int output_pipe = -1;	/* What is written to standard output, */
+static int terminal_fd = -1;	/* and where it really goes. */
+static pthread_t output_thread;
+static long output_bytes = 0;	/* Bytes passed on so far. */
+
+static void *
+count_output (void *arg)
+{
+  char buf [4096], *p;
+  ssize_t n, r;
+
+  while ((n = read (output_pipe, buf, sizeof buf)) != 0)
+    {
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  break;
+	}
+      STATS_ADD (curses_bytes, n);
+      __atomic_add_fetch (&output_bytes, n, __ATOMIC_RELAXED);
+      for (p = buf; n > 0; p += r, n -= r)
+	if ((r = write (terminal_fd, p, n)) == -1)
+	  {
+	    if (errno != EINTR)
+	      return NULL;
+	    r = 0;
+	  }
+    }
+  return NULL;
+}
+
+static void
+start_counting_output (void)
+{
+  int fd [2];
+
+  if (!isatty (1) || !isatty (2))
+    return;
+  if (pipe (fd) == -1)
+    fatal_perror ("pipe");
+  terminal_fd = dup (1);
+  if (terminal_fd == -1 || dup2 (fd [1], 1) == -1)
+    fatal_perror ("dup");
+  close (fd [1]);
+  output_pipe = fd [0];
+  if (pthread_create (&output_thread, NULL, count_output, NULL) != 0)
+    fatal_perror ("pthread_create");
+}
+
+/* Put standard output back, once all that was sent has been passed on. */
+static void
+stop_counting_output (void)
+{
+  if (terminal_fd == -1)
+    return;
+  fflush (stdout);
+  dup2 (terminal_fd, 1);	/* The end of the pipe for the thread. */
+  pthread_join (output_thread, NULL);
+  close (terminal_fd);
+  close (output_pipe);
+  terminal_fd = output_pipe = -1;
+}
+
+/* The bytes passed on to the terminal so far. Those still in the
+ * pipe are not counted yet, so this does not wait for them.
+ */
+static inline long
+bytes_sent (void)
+{
+  return __atomic_load_n (&output_bytes, __ATOMIC_RELAXED);
+}
+
+/* Show or hide the counters in place of the key-help banner. */
+void
+toggle_stats_hud (void)
+{
+  show_stats = !show_stats;
+  draw_keys_banner ();
+  flush_screen ();
 }
 
+#endif /* CASCADE_STATS */
+
 void
 update_screen (state *s)
 {
   char temp [16];
   int i, j;
+  STATS_ONLY (static long bytes_before = 0;)
+  STATS_ONLY (long calls_before = THREAD_STATS->curses_calls;)
 
-  attron (BOLD);
+  if (!colors_ready)
+    init_colors ();
 
   /* Draw the player/machine scores. */
   sprintf (temp, "%04d", s->pscore);
-  mvaddstr (pscore_y, pscore_x, temp);
+  put_string (pscore_y, pscore_x, temp, CELL_BOLD);
   sprintf (temp, "%04d", s->mscore);
-  mvaddstr (mscore_y, mscore_x, temp);
+  put_string (mscore_y, mscore_x, temp, CELL_BOLD);
 
   /* Draw the negate & double flags. */
-  if (s->negate)
-    mvaddstr (negf_y, negf_x, "- NEGATE");
-  else
-    mvaddstr (negf_y, negf_x, "        ");
-  if (s->dooble)
-    mvaddstr (dblf_y, dblf_x, "* DOUBLE");
-  else
-    mvaddstr (dblf_y, dblf_x, "        ");
+  put_string (negf_y, negf_x, s->negate ? "- NEGATE" : "        ", CELL_BOLD);
+  put_string (dblf_y, dblf_x, s->dooble ? "* DOUBLE" : "        ", CELL_BOLD);
+
+  /* Draw the part of the board in view, making its rows if need be. */
+  ensure_board_rows (s, view_top + view_height);
+  for (j = view_top; j < view_top + view_height; ++j)
+    for (i = view_left; i < view_left + view_width; ++i)
+      put_cell (board_y+j-view_top, board_x+i-view_left,
+		board_cell (bd_get (&s->geom, s->board, i, j)));
+
+  /* Draw the performance counters, if they are shown. */
+  STATS_ONLY (if (show_stats) draw_keys_banner ();)
+
+  /* Update the physical terminal. */
+  flush_screen ();
+
+  STATS_ONLY (STATS_ADD (updates, 1);)
+  STATS_ONLY (STATS_SET (last_update_calls,
+			 THREAD_STATS->curses_calls - calls_before);)
+  STATS_ONLY (STATS_SET (last_update_bytes, bytes_sent () - bytes_before);)
+  STATS_ONLY (bytes_before = bytes_sent ();)
+
+  /* Send the same frame to anyone watching. */
+  broadcast_state (s);
+}
 
-  attroff (BOLD);
+/* Keys pressed while the balls are falling are kept here, to be read
+ * by getkey afterwards. Any key also skips the rest of the animation.
+ */
+#define MAX_KEYS_AHEAD 16
 
-  /* Draw the board. */
-  for (j = 0; j < board_height; ++j)
+/* How often (in ms) to send to spectators while waiting for a key. */
+#define BROADCAST_POLL 100
+
+static int keys_ahead [MAX_KEYS_AHEAD];
+static int nr_keys_ahead = 0;
+static int fast_forward = 0;	/* Set when the animation is being skipped. */
+
+/* Returns true if the balls should be shown falling, or false if a
+ * key has been pressed and the rest of this cascade should be skipped.
+ */
+int
+animation_wanted (void)
+{
+  int c;
+
+  if (fast_forward)
+    return 0;
+
+  nodelay (stdscr, TRUE);
+  while (nr_keys_ahead < MAX_KEYS_AHEAD && (c = getch ()) != ERR)
     {
-      move (board_y+j, board_x);
-      for (i = 0; i < board_width; ++i)
-	display_board_char (bd_get (s->board, i, j));
+      keys_ahead [nr_keys_ahead++] = c;
+      fast_forward = 1;
     }
 
-  /* Update the physical terminal. */
-  setsyx (0, 0);
-  refresh ();
+  /* Once the queue is full, leave the rest to curses, but still skip. */
+  if (nr_keys_ahead == MAX_KEYS_AHEAD && (c = getch ()) != ERR)
+    {
+      ungetch (c);
+      fast_forward = 1;
+    }
+  nodelay (stdscr, FALSE);
+
+  return !fast_forward;
+}
+
+/* Called at the end of each cascade. */
+void
+end_animation (void)
+{
+  fast_forward = 0;
+}
+
+/* Forget any keys typed ahead. */
+void
+flush_keys (void)
+{
+  nr_keys_ahead = 0;
+  flushinp ();
 }
 
 /* More low-level screen drawing routines. */
@@ -183,11 +504,41 @@ getkey (void)
 {
   int c, got_key = 0;
 
+  /* Curses shows its screen when it reads a key, but ansi.c does not. */
+  if (ansi_screen)
+    flush_ansi ();
+
   while (!got_key)
     {
-      c = getch ();
+      if (nr_keys_ahead > 0)
+	{
+	  c = keys_ahead [0];
+	  memmove (keys_ahead, keys_ahead + 1, --nr_keys_ahead * sizeof (int));
+	}
+      else if (broadcasting ())
+	{
+	  /* Keep the spectators going while waiting for a key. */
+	  timeout (BROADCAST_POLL);
+	  c = getch ();
+	  timeout (-1);
+	  if (c == ERR)
+	    {
+	      pump_broadcast ();
+	      continue;
+	    }
+	}
+      else
+	c = getch ();
       if (c == 'l' - 'a' + 1) /* ie. ^L - redraw screen */
-	redrawwin (stdscr);
+	{
+	  if (ansi_screen)
+	    {
+	      redraw_ansi ();
+	      flush_ansi ();
+	    }
+	  else
+	    redrawwin (stdscr);
+	}
       else if (c == KEY_BREAK) /* ie. ^C - quit */
 	{
 	  quit = 1;
@@ -204,25 +555,28 @@ getkey (void)
 void
 clear_screen (void)
 {
-  clear ();
+  if (ansi_screen)
+    clear_ansi ();
+  else
+    clear ();
 }
 
 void
 write_centered (int y, const char *s)
 {
-  mvaddstr (y, (width - strlen (s)) / 2, s);
+  put_string (y, (width - strlen (s)) / 2, s, 0);
 }
 
 void
 write_screen (int y, int x, const char *s)
 {
-  mvaddstr (y, x, s);
+  put_string (y, x, s, 0);
 }
 
 void
 clear_line (int y)
 {
-  mvaddstr (y, 0, string (' ', width));
+  put_string (y, 0, string (' ', width), 0);
 }
 
 /* Initialize the screen. */
@@ -230,6 +584,7 @@ clear_line (int y)
 void
 init_screen (void)
 {
+  STATS_ONLY (start_counting_output ();)
   initscr ();
   cbreak ();
   noecho ();
@@ -251,12 +606,24 @@ init_screen (void)
   if (height < 24 || width < 60)
     fatal ("screen or window not large enough to play game\n"
            "height must be >= 25 and width >= 60");
+
+  /* Draw with ansi.c if we can. Let curses clear the screen first,
+   * since it would do so when it first reads a key.
+   */
+  if (!curses_only && ansi_terminal ())
+    {
+      refresh ();
+      start_ansi_screen (1);
+    }
 }
 
 void
 free_screen (void)
 {
+  if (ansi_screen)
+    stop_ansi_screen ();
   endwin ();
+  STATS_ONLY (stop_counting_output ();)
 }
 
 /* This is a convenient place to do the rolling ball animation! */
@@ -264,30 +631,29 @@ free_screen (void)
 static inline void
 draw_ball (int i, int j)
 {
-  attron (BOLD);
-  mvaddch (j, i, 'o');
-  attroff (BOLD);
+  put_cell (j, i, 'o' | CELL_BOLD);
 }
 
 static inline void
 undraw_ball (int i, int j)
 {
-  mvaddch (j, i, ' ');
+  put_cell (j, i, ' ');
 }
 
 static inline void
 refresh_and_wait (int speed)
 {
-  setsyx (0, 0);
-  refresh ();
+  if (!animation_wanted ())
+    return;
+  flush_screen ();
   short_delay (speed);
 }
 
 void
 rolling_ball_animation (state *state_ptr, int i, int j, int who_moved)
 {
-  i += board_x;
-  j += board_y;
+  i += board_x - view_left;
+  j += board_y - view_top;
 
   while (j <= roll_y)
     {
@@ -319,5 +685,5 @@ rolling_ball_animation (state *state_ptr, int i, int j, int who_moved)
 	}
     }
 
-  refresh ();
+  flush_screen ();
 }
@@ -28,21 +28,99 @@ copy_state (const state *s)
   if (s == NULL)
     fatal_perror ("malloc");
   memcpy (copy, s, sizeof (state));
-  copy->board = copy_board (s->board);
+  copy->board = copy_board_rows (&s->geom, s->board, s->rows_ready);
   return copy;
 }
 
 void
 free_state (state *s)
 {
+  free_board (s->board);
   free (s);
 }
 
 void
-generate_board_for_state (state *s)
+generate_board_for_state (state *s, const struct geometry *g)
 {
-  s->board = init_board ();
-  s->balls_in_play = count_balls_on_board (s->board);
+  generate_board_for_state_seeded (s, g, rand ());
+}
+
+/* Boards with more cells than this are made a few rows at a time, so
+ * that starting a game on a huge board does not take long.
+ */
+#define LAZY_BOARD_CELLS 65536
+
+static int
+initial_rows (const struct geometry *g)
+{
+  if (g->width * g->height <= LAZY_BOARD_CELLS)
+    return g->height;
+  else
+    return LAZY_ROWS < g->height ? LAZY_ROWS : g->height;
+}
+
+/* Start a game in "s" on a board of geometry "g". */
+void
+generate_board_for_state_seeded (state *s, const struct geometry *g,
+				 unsigned int seed)
+{
+  s->geom = *g;
+  s->seed = seed;
+  s->rows_ready = initial_rows (g);
+  s->board = init_board_rows (g, seed, s->rows_ready);
+  s->balls_in_play = count_balls_on_rows (g, s->board, s->rows_ready);
+}
+
+/* Start a new game in "s", on a board of the same size, making the
+ * board in the space of the old one, without allocating anything.
+ */
+void
+restart_state_seeded (state *s, unsigned int seed)
+{
+  struct geometry g = s->geom;
+  char *board = s->board;
+
+  memset (s, 0, sizeof (state));
+  s->geom = g;
+  s->board = board;
+  s->seed = seed;
+  s->rows_ready = initial_rows (&g);
+  if (s->rows_ready < g.height)
+    memset (board, 0, g.width * g.height);
+  generate_board_rows (&g, board, seed, NULL, 0, s->rows_ready);
+  s->balls_in_play = count_balls_on_rows (&g, board, s->rows_ready);
+}
+
+/* Make sure that the first "nr_rows" rows of the board have been made,
+ * making a few more besides so that this is not needed on every move.
+ */
+void
+ensure_board_rows (state *s, int nr_rows)
+{
+  if (nr_rows <= s->rows_ready)
+    return;
+  nr_rows += LAZY_ROWS;
+  if (nr_rows > s->geom.height)
+    nr_rows = s->geom.height;
+  generate_board_rows (&s->geom, s->board, s->seed, s->picked,
+		       s->rows_ready, nr_rows);
+  s->rows_ready = nr_rows;
+}
+
+/* The game is over when all the balls have gone, or when there are no
+ * letters left to pick.
+ */
+int
+game_over (const state *s)
+{
+  int i;
+
+  if (s->balls_in_play == 0)
+    return 1;
+  for (i = 0; i < BD_NR_LETTERS; ++i)
+    if (!s->picked [i])
+      return 0;
+  return 1;
 }
 
 static inline int
@@ -60,16 +138,19 @@ set_score (state *s, int who, int score)
     s->pscore = max (s->pscore + score, 0);
   else
     s->mscore = max (s->mscore + score, 0);
+  TRACE (TRACE_SCORE, who, score, who ? s->mscore : s->pscore);
 }
 
 void
 flip_negate (state *s)
 {
   s->negate = !s->negate;
+  TRACE (TRACE_NEGATE, s->negate, 0, 0);
 }
 
 void
 flip_double (state *s)
 {
   s->dooble = !s->dooble;
+  TRACE (TRACE_DOUBLE, s->dooble, 0, 0);
 }
@@ -0,0 +1,185 @@
+/* Cascade (C) 1997 Richard W.M. Jones. */
+
+/* Performance counters. Compiled in only with -DCASCADE_STATS; the
+ * STATS_* macros in cascade.h vanish otherwise, so the counters cost
+ * nothing in a normal build.
+ *
+ * Each thread counts into a copy of its own, so that threads do not
+ * race on the counters or fight over the cache line they are in.
+ * sum_stats adds up the copies. When a thread exits, its counts are
+ * added to those of the threads gone before, and its copy is freed.
+ */
+
+#ifdef CASCADE_STATS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cascade.h"
+
+__thread struct stats *thread_stats = NULL;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;	/* To hear of threads exiting. */
+static struct stats_list {
+  struct stats_list *next;
+  struct stats stats;
+} *live = NULL;
+static struct stats retired;	/* Counts of the threads gone. */
+
+/* Where dump_stats writes, unless $CASCADE_STATS_FILE says otherwise. */
+#define DEFAULT_STATS_FILE "cascade.stats"
+
+/* Add "from" to "to". A thread may be counting into "from" as it is
+ * read, so each counter is read in one go.
+ */
+static void
+add_stats (struct stats *to, const struct stats *from)
+{
+#define ADD(field) \
+  to->field += __atomic_load_n (&from->field, __ATOMIC_RELAXED)
+#define ADD_TIME(field) \
+  do { double t_; __atomic_load (&from->field, &t_, __ATOMIC_RELAXED); \
+       to->field += t_; } while (0)
+  ADD (searches);
+  ADD (nodes);
+  ADD_TIME (search_time);
+  ADD (ball_steps);
+  ADD (cascades);
+  ADD (last_cascade);
+  ADD (longest_cascade);
+  ADD (updates);
+  ADD (curses_calls);
+  ADD (curses_bytes);
+  ADD (last_update_calls);
+  ADD (last_update_bytes);
+  ADD_TIME (delay_time);
+#undef ADD
+#undef ADD_TIME
+}
+
+static void
+retire_thread_stats (void *vp)
+{
+  struct stats_list *l = vp, **lp;
+
+  pthread_mutex_lock (&stats_lock);
+  add_stats (&retired, &l->stats);
+  for (lp = &live; *lp != l; lp = &(*lp)->next)
+    ;
+  *lp = l->next;
+  pthread_mutex_unlock (&stats_lock);
+  free (l);
+}
+
+static void
+make_stats_key (void)
+{
+  if (pthread_key_create (&stats_key, retire_thread_stats) != 0)
+    fatal_perror ("pthread_key_create");
+}
+
+/* The counters of this thread, the first time it counts anything. */
+struct stats *
+new_thread_stats (void)
+{
+  struct stats_list *l = calloc (1, sizeof (struct stats_list));
+
+  if (l == NULL)
+    fatal_perror ("calloc");
+  pthread_once (&stats_once, make_stats_key);
+  pthread_mutex_lock (&stats_lock);
+  l->next = live;
+  live = l;
+  pthread_mutex_unlock (&stats_lock);
+  pthread_setspecific (stats_key, l);
+  return thread_stats = &l->stats;
+}
+
+/* Add up the counters of all the threads. The counters which are
+ * about one move or one update, and the longest cascade, are only
+ * kept by the thread which draws the screen, so they add up too.
+ */
+void
+sum_stats (struct stats *total)
+{
+  struct stats_list *l;
+
+  memset (total, 0, sizeof (struct stats));
+  pthread_mutex_lock (&stats_lock);
+  add_stats (total, &retired);
+  for (l = live; l != NULL; l = l->next)
+    add_stats (total, &l->stats);
+  pthread_mutex_unlock (&stats_lock);
+}
+
+static double
+per_second (double n, double t)
+{
+  return t > 0 ? n / t : 0;
+}
+
+/* Format the counters into one line of the screen, "n" bytes long. */
+void
+format_stats_hud (char *buf, int n)
+{
+  struct stats stats;
+
+  sum_stats (&stats);
+  snprintf (buf, n,
+	    "nodes %ld %.0f/s | steps %ld cascade %ld/%ld | "
+	    "update %ld calls %ld bytes | delay %.1fs",
+	    stats.nodes, per_second (stats.nodes, stats.search_time),
+	    stats.ball_steps, stats.last_cascade, stats.longest_cascade,
+	    stats.last_update_calls, stats.last_update_bytes,
+	    stats.delay_time);
+}
+
+void
+write_stats (FILE *fp)
+{
+  struct stats stats;
+
+  sum_stats (&stats);
+  fprintf (fp, "searches          %ld\n", stats.searches);
+  fprintf (fp, "nodes             %ld\n", stats.nodes);
+  fprintf (fp, "search_time       %.6f\n", stats.search_time);
+  fprintf (fp, "nodes_per_sec     %.1f\n",
+	   per_second (stats.nodes, stats.search_time));
+  fprintf (fp, "ball_steps        %ld\n", stats.ball_steps);
+  fprintf (fp, "cascades          %ld\n", stats.cascades);
+  fprintf (fp, "last_cascade      %ld\n", stats.last_cascade);
+  fprintf (fp, "longest_cascade   %ld\n", stats.longest_cascade);
+  fprintf (fp, "updates           %ld\n", stats.updates);
+  fprintf (fp, "curses_calls      %ld\n", stats.curses_calls);
+  fprintf (fp, "curses_bytes      %ld\n", stats.curses_bytes);
+  fprintf (fp, "calls_per_update  %.1f\n",
+	   stats.updates ? (double) stats.curses_calls / stats.updates : 0);
+  fprintf (fp, "bytes_per_update  %.1f\n",
+	   stats.updates ? (double) stats.curses_bytes / stats.updates : 0);
+  fprintf (fp, "delay_time        %.6f\n", stats.delay_time);
+}
+
+/* Write the counters to the stats file, at exit. */
+void
+dump_stats (void)
+{
+  const char *filename = getenv ("CASCADE_STATS_FILE");
+  FILE *fp;
+
+  if (filename == NULL)
+    filename = DEFAULT_STATS_FILE;
+  fp = fopen (filename, "w");
+  if (fp == NULL)
+    {
+      perror (filename);
+      return;
+    }
+  write_stats (fp);
+  fclose (fp);
+}
+
+#endif /* CASCADE_STATS */
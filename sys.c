@@ -11,8 +11,20 @@ void
 short_delay (int speed)
 {
   struct timespec t;
+  STATS_ONLY (double started = current_time ();)
 
   t.tv_sec = 0;
   t.tv_nsec = 10 * 1000000 / speed;
   nanosleep (&t, NULL);
+  STATS_ADD (delay_time, current_time () - started);
+}
+
+/* Return a monotonic time in seconds, for measuring intervals. */
+double
+current_time (void)
+{
+  struct timespec t;
+
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
 }
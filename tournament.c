@@ -0,0 +1,466 @@
+/* Cascade (C) 1997 Richard W.M. Jones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <assert.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cascade.h"
+
+/* Headless self-play tournament between two engines, run on all
+ * processors at once. Every board is played twice with the same seed,
+ * once with each engine moving first, so that the luck of the board
+ * cancels out. The results are a strength regression check, and the
+ * games/sec figure is an end-to-end throughput benchmark.
+ *
+ * With -S, one thread hosts many games at once instead, as a server
+ * would, and hands every machine move to the scheduler (sched.c). The
+ * moves then depend on the load, as the scheduler cuts the depth of
+ * the searches when its queue backs up.
+ */
+
+struct engine {
+  const char *name;
+  int level;			/* Difficulty level, or 0 to move at random. */
+  int ply;			/* If > 0, search this deep with no omits. */
+};
+
+struct results {
+  long games;
+  long moves;
+  long a_wins, b_wins, draws;
+  double margin, margin_squared; /* Sum of A's score minus B's. */
+};
+
+static struct engine engine_a, engine_b;
+static long nr_games = 10000;
+static unsigned int base_seed = 1;
+static double budget = 0;	/* Seconds per move, 0 = search to full ply. */
+static int keep_trees = 0;	/* Keep search trees from move to move. */
+static struct record_store *store = NULL; /* Where games are recorded. */
+static const char *band_dir = NULL; /* Where boards are kept in bands. */
+static long next_game = 0;	/* Next game to hand out to a thread. */
+static struct geometry geometry;	/* Size of the boards. */
+static int nr_hosted = 0;	/* Games played at once by the scheduler. */
+static int max_queued = 0;	/* Size of the scheduler's queue. */
+
+#define BAND_BYTES (1 << 20)	/* Size of each band of a board on disk, */
+#define BAND_RESIDENT 16		/* and the most mapped at once. */
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+	   "usage: tournament [-n games] [-j threads] [-s seed] [-r]\n"
+	   "                  [-w width] [-h height] [-t secs] [-o dir]\n"
+	   "                  [-B dir] [-S games [-Q queue]] engine engine\n"
+	   "where an engine is a difficulty level (1-5), \"random\",\n"
+	   "or \"plyN\" to search N moves ahead without any omits\n"
+	   "(N odd).\n"
+	   "-B keeps the boards on disk in dir, for random engines only\n"
+	   "-S plays that many games at once on one thread, with the\n"
+	   "searches run by the scheduler on the other threads, whose\n"
+	   "queue holds -Q moves (default 2 per thread)\n");
+  exit (1);
+}
+
+/* The ply must be odd, as the search only goes to odd depths. */
+static void
+parse_engine (struct engine *e, const char *name)
+{
+  char *end;
+  long ply;
+
+  e->name = name;
+  e->ply = 0;
+  if (strcmp (name, "random") == 0)
+    e->level = 0;
+  else if (strncmp (name, "ply", 3) == 0)
+    {
+      ply = strtol (name + 3, &end, 10);
+      if (!isdigit ((unsigned char) name [3]) || *end != '\0' ||
+	  ply < 1 || ply > INT_MAX || ply % 2 == 0)
+	usage ();
+      e->level = 3;
+      e->ply = ply;
+    }
+  else if (strlen (name) == 1 && '1' <= name [0] && name [0] <= '5')
+    e->level = name [0] - '0';
+  else
+    usage ();
+}
+
+/* Fill in the search parameters of engine "e" playing "who". */
+static void
+engine_params (const struct engine *e, int who, struct search_tree *tree,
+	       struct search_params *params)
+{
+  init_search_params (params, e->level);
+  if (e->ply > 0)
+    params->ply = e->ply;
+  params->side = who;
+  params->tree = tree;
+  if (budget > 0)
+    params->deadline = current_time () + budget;
+}
+
+/* Choose a letter at random for "s". */
+static int
+random_move (const state *s, unsigned int *rng)
+{
+  int i, n = 0, choice [BD_NR_LETTERS];
+
+  for (i = 0; i < BD_NR_LETTERS; ++i)
+    if (!s->picked [i])
+      choice [n++] = i;
+  assert (n > 0);
+  return letters [choice [rand_r (rng) % n]];
+}
+
+/* Choose a letter for "who" to play in "s". */
+static int
+engine_move (const struct engine *e, const state *s, int who,
+	     unsigned int *rng, struct search_tree *tree)
+{
+  struct search_params params;
+
+  if (e->level == 0)
+    return random_move (s, rng);
+  engine_params (e, who, tree, &params);
+  return search_machine_move (s, &params);
+}
+
+/* One game in play. */
+struct game {
+  long g;			/* Game number. */
+  unsigned int rng;
+  const struct engine *e [2];
+  int a_side;			/* Side that engine A plays. */
+  int who;			/* Side to move. */
+  struct search_tree *trees [2];
+  struct game_record record;
+  struct band_board *bands;
+  state *s;
+  int letter;			/* Move chosen by the scheduler. */
+  struct game *next;		/* Next game with a move ready. */
+};
+
+/* Set up game number "g". */
+static void
+start_game (struct game *gm, long g)
+{
+  unsigned int seed = base_seed + g/2;
+
+  gm->g = g;
+  gm->rng = seed ^ 0x9e3779b9;
+  gm->a_side = g & 1;
+  gm->e [gm->a_side] = &engine_a;
+  gm->e [!gm->a_side] = &engine_b;
+  gm->who = 0;
+  gm->trees [0] = gm->trees [1] = NULL;
+  gm->bands = NULL;
+
+  gm->s = init_state ();
+  if (band_dir)
+    {
+      char *path = malloc (strlen (band_dir) + 32);
+
+      if (path == NULL)
+	fatal_perror ("malloc");
+      sprintf (path, "%s/board.%ld", band_dir, g);
+      gm->bands = open_band_board (path, gm->s, &geometry, seed,
+				   BAND_BYTES / geometry.width + 1,
+				   BAND_RESIDENT);
+      if (gm->bands == NULL)
+	fatal_perror (path);
+      free (path);
+    }
+  else
+    generate_board_for_state_seeded (gm->s, &geometry, seed);
+  if (keep_trees)
+    {
+      gm->trees [0] = init_search_tree ();
+      gm->trees [1] = init_search_tree ();
+    }
+  if (store)
+    init_game_record (&gm->record, &geometry);
+}
+
+/* Play "letter" for the side to move, and count it in "r". */
+static void
+play_move (struct game *gm, int letter, struct results *r)
+{
+  state *s = gm->s;
+
+  s->picked [strchr (letters, letter) - letters] = 1;
+  if (gm->bands)
+    play_letter_in_bands (gm->bands, gm->who, letter);
+  else
+    {
+      remove_letter_from_board (&s->geom, s->board, letter);
+      if (store)
+	begin_move_record (&gm->record, s);
+      drop_balls (s->board, s, gm->who, 0);
+      if (store)
+	end_move_record (&gm->record, s, gm->who, letter);
+    }
+  r->moves ++;
+  gm->who = !gm->who;
+}
+
+/* Add the finished game to "r", and free it. */
+static void
+finish_game (struct game *gm, struct results *r)
+{
+  state *s = gm->s;
+  int margin;
+
+  margin = gm->a_side == 0 ? s->pscore - s->mscore : s->mscore - s->pscore;
+  if (margin > 0)
+    r->a_wins ++;
+  else if (margin < 0)
+    r->b_wins ++;
+  else
+    r->draws ++;
+  r->margin += margin;
+  r->margin_squared += (double) margin * margin;
+  r->games ++;
+
+  if (store)
+    {
+      append_game_record (store, &gm->record);
+      free_game_record (&gm->record);
+    }
+  free_search_tree (gm->trees [0]);
+  free_search_tree (gm->trees [1]);
+  if (gm->bands)
+    close_band_board (gm->bands);
+  free_state (s);
+}
+
+/* Play game number "g" and add it to "r". */
+static void
+play_one_game (long g, struct results *r)
+{
+  struct game gm;
+
+  start_game (&gm, g);
+  while (!game_over (gm.s))
+    play_move (&gm, engine_move (gm.e [gm.who], gm.s, gm.who, &gm.rng,
+				 gm.trees [gm.who]), r);
+  finish_game (&gm, r);
+}
+
+/* Games with a move ready, for the scheduled tournament. */
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+static struct game *ready = NULL;
+
+static void
+move_ready (void *vp, int letter, const struct search_params *params)
+{
+  struct game *gm = (struct game *) vp;
+
+  pthread_mutex_lock (&ready_lock);
+  gm->letter = letter;
+  gm->next = ready;
+  ready = gm;
+  pthread_cond_signal (&ready_cond);
+  pthread_mutex_unlock (&ready_lock);
+}
+
+/* Ask for the next move in "gm". */
+static void
+request_move (struct scheduler *sched, struct game *gm)
+{
+  const struct engine *e = gm->e [gm->who];
+  struct search_params params;
+
+  if (e->level == 0)
+    move_ready (gm, random_move (gm->s, &gm->rng), NULL);
+  else
+    {
+      engine_params (e, gm->who, gm->trees [gm->who], &params);
+      schedule_machine_move (sched, gm->s, &params, move_ready, gm);
+    }
+}
+
+/* Play every game on this thread, "nr_hosted" at a time, with the
+ * searches done by "nr_threads" scheduler workers.
+ */
+static void
+play_scheduled_games (int nr_threads, struct results *r,
+		      struct scheduler_metrics *metrics_rtn)
+{
+  struct scheduler *sched = init_scheduler (nr_threads, max_queued);
+  struct game *games, *gm;
+  int i, live = 0;
+
+  games = malloc (nr_hosted * sizeof (struct game));
+  if (games == NULL)
+    fatal_perror ("malloc");
+  for (i = 0; i < nr_hosted && next_game < nr_games; ++i)
+    {
+      start_game (&games [i], next_game++);
+      live ++;
+      request_move (sched, &games [i]);
+    }
+
+  while (live > 0)
+    {
+      pthread_mutex_lock (&ready_lock);
+      while (ready == NULL)
+	pthread_cond_wait (&ready_cond, &ready_lock);
+      gm = ready;
+      ready = gm->next;
+      pthread_mutex_unlock (&ready_lock);
+
+      play_move (gm, gm->letter, r);
+      if (game_over (gm->s))
+	{
+	  finish_game (gm, r);
+	  if (next_game >= nr_games)
+	    {
+	      live --;
+	      continue;
+	    }
+	  start_game (gm, next_game++);
+	}
+      request_move (sched, gm);
+    }
+
+  get_scheduler_metrics (sched, metrics_rtn);
+  free_scheduler (sched);
+  free (games);
+}
+
+static void *
+play_games (void *vp)
+{
+  struct results *r = (struct results *) vp;
+  long g;
+
+  while ((g = __sync_fetch_and_add (&next_game, 1)) < nr_games)
+    play_one_game (g, r);
+
+  return NULL;
+}
+
+int
+main (int argc, char *argv [])
+{
+  struct results total, *results;
+  struct scheduler_metrics metrics;
+  pthread_t *threads;
+  int c, i, nr_threads = sysconf (_SC_NPROCESSORS_ONLN);
+  int w = 40, h = 20;
+  double start, elapsed, n, p, p_err, mean, sd;
+
+  while ((c = getopt (argc, argv, "n:j:s:w:h:t:ro:B:S:Q:")) != -1)
+    switch (c)
+      {
+      case 'n': nr_games = atol (optarg); break;
+      case 'j': nr_threads = atoi (optarg); break;
+      case 's': base_seed = strtoul (optarg, NULL, 0); break;
+      case 'w': w = atoi (optarg); break;
+      case 'h': h = atoi (optarg); break;
+      case 't': budget = atof (optarg); break;
+      case 'r': keep_trees = 1; break;
+      case 'o':
+	store = open_record_store (optarg);
+	if (store == NULL)
+	  {
+	    perror (optarg);
+	    exit (1);
+	  }
+	break;
+      case 'B': band_dir = optarg; break;
+      case 'S': nr_hosted = atoi (optarg); break;
+      case 'Q': max_queued = atoi (optarg); break;
+      default: usage ();
+      }
+  if (argc - optind != 2 || nr_games < 1 || nr_threads < 1 ||
+      w < 20 || h < 15 || nr_hosted < 0 || max_queued < 0 ||
+      (max_queued > 0 && nr_hosted == 0))
+    usage ();
+  if (max_queued == 0)
+    max_queued = 2 * nr_threads;
+  parse_engine (&engine_a, argv [optind]);
+  parse_engine (&engine_b, argv [optind+1]);
+  if (band_dir && (engine_a.level != 0 || engine_b.level != 0 || store))
+    usage ();
+  init_geometry (&geometry, w, h);
+
+  results = calloc (nr_threads, sizeof (struct results));
+  threads = malloc (nr_threads * sizeof (pthread_t));
+  if (results == NULL || threads == NULL)
+    fatal_perror ("malloc");
+
+  TRACE_ONLY (start_trace ();)
+  start = current_time ();
+  if (nr_hosted > 0)
+    play_scheduled_games (nr_threads, &results [0], &metrics);
+  else
+    for (i = 0; i < nr_threads; ++i)
+      if (pthread_create (&threads [i], NULL, play_games, &results [i]) != 0)
+	fatal ("cannot create thread");
+  memset (&total, 0, sizeof total);
+  for (i = 0; i < nr_threads; ++i)
+    {
+      if (nr_hosted == 0)
+	pthread_join (threads [i], NULL);
+      total.games += results [i].games;
+      total.moves += results [i].moves;
+      total.a_wins += results [i].a_wins;
+      total.b_wins += results [i].b_wins;
+      total.draws += results [i].draws;
+      total.margin += results [i].margin;
+      total.margin_squared += results [i].margin_squared;
+    }
+  elapsed = current_time () - start;
+  TRACE_ONLY (stop_trace ();)
+
+  /* Score counts a draw as half a win. The error bars are the normal
+   * approximation at 95% confidence.
+   */
+  n = total.games;
+  p = (total.a_wins + total.draws / 2.0) / n;
+  p_err = 1.96 * sqrt (p * (1 - p) / n);
+  mean = total.margin / n;
+  sd = n > 1 ? sqrt ((total.margin_squared - n * mean * mean) / (n - 1)) : 0;
+
+  printf ("%s vs %s: %ld games on %dx%d boards, seed %u, %d threads\n",
+	  engine_a.name, engine_b.name, total.games,
+	  w, h, base_seed, nr_threads);
+  printf ("score of %s:  %.2f%% +/- %.2f%%  (won %ld, drew %ld, lost %ld)\n",
+	  engine_a.name, 100 * p, 100 * p_err,
+	  total.a_wins, total.draws, total.b_wins);
+  printf ("margin:       %+.3f +/- %.3f points per game\n",
+	  mean, 1.96 * sd / sqrt (n));
+  printf ("speed:        %.1f games/sec, %.1f moves/sec (%.2f s)\n",
+	  n / elapsed, total.moves / elapsed, elapsed);
+  if (nr_hosted > 0)
+    {
+      printf ("scheduler:    %d games at once, queue of %d: "
+	      "most waiting %d\n",
+	      nr_hosted, max_queued, metrics.max_queue_depth);
+      printf ("searches:     %ld, %ld shed, %ld degraded, %ld late\n",
+	      metrics.completed, metrics.shed, metrics.degraded,
+	      metrics.late);
+      printf ("wait:         %.2f ms mean, %.2f ms max\n",
+	      metrics.completed ? 1000 * metrics.total_wait
+	      / metrics.completed : 0,
+	      1000 * metrics.max_wait);
+    }
+
+  if (store)
+    close_record_store (store);
+  free (threads);
+  free (results);
+  exit (0);
+}
@@ -0,0 +1,425 @@
+/* Cascade (C) 1997 Richard W.M. Jones. */
+
+/* Event tracing. Compiled in only with -DCASCADE_TRACE, and then only
+ * on if $CASCADE_TRACE_FILE names a file to write. The trace is in the
+ * Chrome trace format, so it can be loaded into chrome://tracing or
+ * Perfetto to see each thread's search and cascades on a timeline.
+ * $CASCADE_TRACE_EVENTS picks what to trace, as a list of "ball",
+ * "floor", "score", "flags", "drop" and "node" (default all).
+ *
+ * Each thread puts its events into a ring of its own, without locks:
+ * only the thread moves the head, and only the writer thread, which
+ * empties the rings every millisecond, moves the tail. If a ring fills
+ * up, its events are dropped and counted, rather than hold up the
+ * thread. The writer just copies the events as they are into FILE.raw,
+ * which is turned into the trace proper when tracing stops, so that
+ * formatting the trace does not slow the program while it is traced.
+ * When a thread exits, its ring is marked finished, and the writer
+ * frees it once it has been emptied for the last time, so threads
+ * which come and go (eg. those choosing each new board) leave nothing
+ * behind.
+ *
+ * Reading the clock costs more than the rest of an event, so only the
+ * spans (moves dropping balls, and search nodes) read it; the events
+ * within a span carry its time, and their order in the file is the
+ * order they happened in. Where there is a cycle counter, that is the
+ * clock, scaled to real time at the end.
+ */
+
+#ifdef CASCADE_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cascade.h"
+
+#define TRACE_RING_SIZE 65536	/* Events per thread, a power of 2. */
+#define DRAIN_INTERVAL 1000000	/* Nanoseconds between drains. */
+
+struct trace_record {
+  long long time;		/* Ticks of read_clock. */
+  int type, a, b, c;
+};
+
+struct trace_ring {
+  struct trace_ring *next;
+  int tid;			/* Number of the thread, from 1. */
+  long long now;		/* Time of the current span. */
+  long dropped;			/* Events lost with the ring full. */
+  int finished;			/* Set when the thread has exited. */
+  unsigned long head;		/* Moved by the thread ... */
+  char pad [64];
+  unsigned long tail;		/* ... and by the writer. */
+  struct trace_record records [TRACE_RING_SIZE];
+};
+
+unsigned int trace_mask = 0;
+
+static __thread struct trace_ring *ring = NULL;
+static struct trace_ring *rings = NULL;
+static int nr_rings = 0;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;	/* To hear of threads exiting. */
+
+static FILE *raw_fp;		/* Events as drained, ... */
+static char *raw_filename;
+static FILE *trace_fp;		/* ... and as written at the end. */
+static const char *trace_filename;
+static long long start_ns, start_ticks;
+static double ns_per_tick;
+static int first_record;
+static long dropped;		/* Events dropped by all the threads. */
+static volatile int stopping;
+static pthread_t writer;
+
+static const struct {
+  const char *name;
+  unsigned int mask;
+} categories [] = {
+  { "ball", 1 << TRACE_BALL_FALLS },
+  { "floor", 1 << TRACE_BALL_TO_FLOOR },
+  { "score", 1 << TRACE_SCORE },
+  { "flags", 1 << TRACE_NEGATE | 1 << TRACE_DOUBLE },
+  { "drop", 1 << TRACE_DROP | 1 << TRACE_DROP_END },
+  { "node", 1 << TRACE_NODE | 1 << TRACE_NODE_END },
+};
+#define NR_CATEGORIES (sizeof categories / sizeof categories [0])
+
+static long long
+clock_ns (void)
+{
+  struct timespec t;
+
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+#if defined (__x86_64__) || defined (__i386__)
+#define read_clock() ((long long) __builtin_ia32_rdtsc ())
+#else
+#define read_clock() clock_ns ()
+#endif
+
+static struct trace_ring *
+new_ring (void)
+{
+  struct trace_ring *r = calloc (1, sizeof (struct trace_ring));
+
+  if (r == NULL)
+    fatal_perror ("calloc");
+  pthread_mutex_lock (&rings_lock);
+  r->tid = ++nr_rings;
+  r->now = read_clock ();
+  r->next = rings;
+  rings = r;
+  pthread_mutex_unlock (&rings_lock);
+  pthread_setspecific (ring_key, r);
+  return r;
+}
+
+/* Called as a thread which has traced exits. */
+static void
+finish_ring (void *vp)
+{
+  struct trace_ring *r = vp;
+
+  __atomic_store_n (&r->finished, 1, __ATOMIC_RELEASE);
+}
+
+void
+trace_event (int type, int a, int b, int c, int span)
+{
+  struct trace_ring *r = ring;
+  struct trace_record *e;
+  unsigned long head;
+
+  if (r == NULL)
+    r = ring = new_ring ();
+  if (span)
+    r->now = read_clock ();
+
+  head = r->head;
+  if (head - __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE)
+    {
+      r->dropped ++;
+      return;
+    }
+  e = &r->records [head & (TRACE_RING_SIZE-1)];
+  e->time = r->now;
+  e->type = type;
+  e->a = a;
+  e->b = b;
+  e->c = c;
+  __atomic_store_n (&r->head, head+1, __ATOMIC_RELEASE);
+}
+
+static void
+write_record (int tid, const struct trace_record *e)
+{
+  static const char *cells [] = {
+    "empty", "wall", "brick", "ball", "negate", "double", "heart"
+  };
+  FILE *fp = trace_fp;
+  long long ns = (e->time - start_ticks) * ns_per_tick;
+
+  fprintf (fp, "%s\n{\"pid\":1,\"tid\":%d,\"ts\":%lld.%03d,",
+	   first_record ? "" : ",", tid, ns / 1000, (int) (ns % 1000));
+  first_record = 0;
+
+  switch (e->type)
+    {
+    case TRACE_BALL_FALLS:
+      fprintf (fp, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"ball_falls\","
+	       "\"args\":{\"x\":%d,\"y\":%d,\"into\":\"", e->a, e->b);
+      if (e->c <= BD_HEART)
+	fprintf (fp, "%s\"}}", cells [e->c]);
+      else
+	fprintf (fp, "%c\"}}", e->c);
+      break;
+    case TRACE_BALL_TO_FLOOR:
+      fprintf (fp, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"ball_falls_to_floor\","
+	       "\"args\":{\"x\":%d,\"y\":%d}}", e->a, e->b);
+      break;
+    case TRACE_SCORE:
+      fprintf (fp, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"set_score\","
+	       "\"args\":{\"who\":\"%s\",\"points\":%d,\"score\":%d}}",
+	       e->a ? "machine" : "player", e->b, e->c);
+      break;
+    case TRACE_NEGATE:
+    case TRACE_DOUBLE:
+      fprintf (fp, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\","
+	       "\"args\":{\"now\":%d}}",
+	       e->type == TRACE_NEGATE ? "flip_negate" : "flip_double", e->a);
+      break;
+    case TRACE_DROP:
+      fprintf (fp, "\"ph\":\"B\",\"name\":\"drop_balls\","
+	       "\"args\":{\"who\":\"%s\",\"balls\":%d}}",
+	       e->a ? "machine" : "player", e->b);
+      break;
+    case TRACE_DROP_END:
+      fprintf (fp, "\"ph\":\"E\",\"args\":{\"balls left\":%d}}", e->a);
+      break;
+    case TRACE_NODE:
+      fprintf (fp, "\"ph\":\"B\",\"name\":\"%c\","
+	       "\"args\":{\"depth\":%d,\"who\":\"%s\"}}",
+	       letters [e->a], e->b, e->c ? "machine" : "player");
+      break;
+    case TRACE_NODE_END:
+      fprintf (fp, "\"ph\":\"E\",\"args\":{\"value\":%d}}", e->a);
+      break;
+    }
+}
+
+/* Write a run of "n" events of thread "tid" to the raw file. A run
+ * with n == -1 instead ends the thread, and holds its dropped count.
+ */
+static void
+write_raw (int tid, int n, const void *data, size_t size)
+{
+  if (fwrite (&tid, sizeof tid, 1, raw_fp) != 1 ||
+      fwrite (&n, sizeof n, 1, raw_fp) != 1 ||
+      fwrite (data, size, 1, raw_fp) != 1)
+    fatal_perror (raw_filename);
+}
+
+/* Copy what the threads have traced so far into the raw file, and
+ * free the rings of threads which have exited.
+ */
+static void
+drain_rings (void)
+{
+  struct trace_ring *r, **rp;
+
+  pthread_mutex_lock (&rings_lock);
+  r = rings;
+  pthread_mutex_unlock (&rings_lock);
+
+  /* New rings go on the front, so the list from here on is fixed. */
+  for (; r != NULL; r = r->next)
+    {
+      unsigned long tail = r->tail;
+      unsigned long head;
+
+      /* Once finished is seen, head has moved for the last time. */
+      if (__atomic_load_n (&r->finished, __ATOMIC_ACQUIRE))
+	r->finished = 2;
+      head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+
+      while (tail != head)
+	{
+	  int start = tail & (TRACE_RING_SIZE-1);
+	  int n = head - tail;
+
+	  if (n > TRACE_RING_SIZE - start)
+	    n = TRACE_RING_SIZE - start;
+	  write_raw (r->tid, n, &r->records [start],
+		     n * sizeof (struct trace_record));
+	  tail += n;
+	}
+      __atomic_store_n (&r->tail, tail, __ATOMIC_RELEASE);
+    }
+
+  /* Only the writer takes rings off the list, but threads put new ones
+   * on the front, so this is done under the lock.
+   */
+  pthread_mutex_lock (&rings_lock);
+  for (rp = &rings; (r = *rp) != NULL; )
+    if (r->finished == 2)
+      {
+	write_raw (r->tid, -1, &r->dropped, sizeof r->dropped);
+	*rp = r->next;
+	free (r);
+      }
+    else
+      rp = &r->next;
+  pthread_mutex_unlock (&rings_lock);
+}
+
+static void
+write_thread_name (int tid, long nr_dropped)
+{
+  fprintf (trace_fp, "%s\n{\"pid\":1,\"tid\":%d,\"ph\":\"M\","
+	   "\"name\":\"thread_name\",\"args\":{\"name\":\"thread %d%s\"}}",
+	   first_record ? "" : ",", tid, tid,
+	   nr_dropped ? " (events dropped)" : "");
+  first_record = 0;
+  dropped += nr_dropped;
+}
+
+/* Turn the raw file into the trace. */
+static void
+write_trace_file (void)
+{
+  struct trace_record *records;
+  int tid, n, i;
+
+  records = malloc (TRACE_RING_SIZE * sizeof (struct trace_record));
+  if (records == NULL)
+    fatal_perror ("malloc");
+  rewind (raw_fp);
+  while (fread (&tid, sizeof tid, 1, raw_fp) == 1 &&
+	 fread (&n, sizeof n, 1, raw_fp) == 1)
+    if (n == -1)
+      {
+	long nr_dropped;
+
+	if (fread (&nr_dropped, sizeof nr_dropped, 1, raw_fp) != 1)
+	  break;
+	write_thread_name (tid, nr_dropped);
+      }
+    else if (fread (records, sizeof (struct trace_record), n, raw_fp) == n)
+      for (i = 0; i < n; ++i)
+	write_record (tid, &records [i]);
+    else
+      break;
+  free (records);
+}
+
+static void *
+drain_trace (void *arg)
+{
+  struct timespec t;
+
+  t.tv_sec = 0;
+  t.tv_nsec = DRAIN_INTERVAL;
+  while (!stopping)
+    {
+      drain_rings ();
+      nanosleep (&t, NULL);
+    }
+  drain_rings ();
+  return NULL;
+}
+
+/* Start tracing, if $CASCADE_TRACE_FILE is set. */
+void
+start_trace (void)
+{
+  const char *events = getenv ("CASCADE_TRACE_EVENTS");
+  unsigned int mask = 0;
+  int i;
+
+  trace_filename = getenv ("CASCADE_TRACE_FILE");
+  if (trace_filename == NULL)
+    return;
+
+  if (events == NULL)
+    mask = (1 << TRACE_NR_TYPES) - 1;
+  else
+    for (i = 0; i < NR_CATEGORIES; ++i)
+      if (strstr (events, categories [i].name))
+	mask |= categories [i].mask;
+
+  raw_filename = malloc (strlen (trace_filename) + 5);
+  if (raw_filename == NULL)
+    fatal_perror ("malloc");
+  sprintf (raw_filename, "%s.raw", trace_filename);
+  trace_fp = fopen (trace_filename, "w");
+  raw_fp = fopen (raw_filename, "w+");
+  if (trace_fp == NULL || raw_fp == NULL)
+    {
+      perror (trace_fp == NULL ? trace_filename : raw_filename);
+      if (trace_fp != NULL)
+	fclose (trace_fp);
+      trace_fp = NULL;
+      free (raw_filename);
+      return;
+    }
+  fprintf (trace_fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  first_record = 1;
+  dropped = 0;
+  if (pthread_key_create (&ring_key, finish_ring) != 0)
+    fatal_perror ("pthread_key_create");
+  start_ns = clock_ns ();
+  start_ticks = read_clock ();
+  stopping = 0;
+  if (pthread_create (&writer, NULL, drain_trace, NULL) != 0)
+    fatal_perror ("pthread_create");
+  trace_mask = mask;
+}
+
+/* Stop tracing, and finish off the file. Call once the other threads
+ * have stopped, or at least stopped making events.
+ */
+void
+stop_trace (void)
+{
+  struct trace_ring *r;
+
+  if (trace_fp == NULL)
+    return;
+
+  trace_mask = 0;
+  stopping = 1;
+  pthread_join (writer, NULL);
+  pthread_key_delete (ring_key);
+  ns_per_tick = (double) (clock_ns () - start_ns) /
+    (read_clock () - start_ticks + 1);
+  write_trace_file ();
+  fclose (raw_fp);
+  unlink (raw_filename);
+  free (raw_filename);
+
+  while ((r = rings) != NULL)
+    {
+      write_thread_name (r->tid, r->dropped);
+      rings = r->next;
+      free (r);
+    }
+  nr_rings = 0;
+  ring = NULL;
+  fprintf (trace_fp, "\n]}\n");
+  if (fclose (trace_fp) == EOF)
+    perror (trace_filename);
+  trace_fp = NULL;
+
+  if (dropped)
+    fprintf (stderr, "%s: %ld events dropped with a ring full\n",
+	     trace_filename, dropped);
+}
+
+#endif /* CASCADE_TRACE */
@@ -0,0 +1,227 @@
+/* Cascade (C) 1997 Richard W.M. Jones. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef HAVE_NCURSES
+#include <ncurses.h>
+#else
+#include <curses.h>
+#endif
+
+#include "cascade.h"
+
+/* Watch a game which is being played with "cascade -b SOCKET". The
+ * frames it sends (see broadcast.c) are applied to a copy of the
+ * board, which is drawn just as the game draws its own.
+ */
+
+volatile int quit = 0;
+
+static state *s;
+static unsigned char *payload = NULL;
+static size_t payload_size = 0;
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: cascade-watch SOCKET\n");
+  exit (1);
+}
+
+static unsigned int
+get_u32 (const unsigned char *p)
+{
+  return (p [0] << 24) | (p [1] << 16) | (p [2] << 8) | p [3];
+}
+
+/* Read exactly "n" bytes. Returns false at the end of the stream. */
+static int
+read_fully (int fd, void *vp, size_t n)
+{
+  unsigned char *p = vp;
+
+  while (n > 0)
+    {
+      ssize_t r = read (fd, p, n);
+
+      if (r == -1 && errno == EINTR)
+	continue;
+      if (r <= 0)
+	return 0;
+      p += r;
+      n -= r;
+    }
+  return 1;
+}
+
+static const unsigned char *
+get_scores (const unsigned char *p)
+{
+  s->pscore = get_u32 (p);
+  s->mscore = get_u32 (p + 4);
+  s->negate = p [8];
+  s->dooble = p [9];
+  return p + FRAME_SCORES;
+}
+
+static void
+keyframe (const unsigned char *p, size_t len)
+{
+  int w, h;
+
+  p = get_scores (p);
+  w = get_u32 (p);
+  h = get_u32 (p + 4);
+  p += 8;
+  if (len != FRAME_SCORES + 8 + (size_t) w * h)
+    fatal ("bad keyframe");
+
+  if (s->board == NULL || w != board_width || h != board_height)
+    {
+      free_board (s->board);
+      virtual_width = w;
+      virtual_height = h;
+      layout_screen ();
+      s->board = malloc (w * h);
+      if (s->board == NULL)
+	fatal_perror ("malloc");
+      init_geometry (&s->geom, w, h);
+    }
+  memcpy (s->board, p, w * h);
+  s->rows_ready = board_height;
+  draw_screen (s);
+}
+
+static void
+delta (const unsigned char *p, size_t len)
+{
+  long n, k;
+
+  if (s->board == NULL)
+    return;
+  p = get_scores (p);
+  n = get_u32 (p);
+  p += 4;
+  if (len != FRAME_SCORES + 4 + 5 * n)
+    fatal ("bad frame");
+
+  for (k = 0; k < n; ++k, p += 5)
+    {
+      long c = get_u32 (p);
+
+      if (c >= (long) board_width * board_height)
+	fatal ("bad frame");
+      s->board [c] = p [4];
+      if (p [4] == BD_BALL)
+	follow_ball (c % board_width, c / board_width);
+    }
+  update_screen (s);
+}
+
+/* Read and show one frame. Returns false when the game has gone. */
+static int
+read_frame (int fd)
+{
+  unsigned char header [FRAME_HEADER];
+  size_t len;
+
+  if (!read_fully (fd, header, FRAME_HEADER))
+    return 0;
+  len = get_u32 (header + 1);
+  if (len > payload_size)
+    {
+      free (payload);
+      payload = malloc (len);
+      if (payload == NULL)
+	fatal_perror ("malloc");
+      payload_size = len;
+    }
+  if (!read_fully (fd, payload, len))
+    return 0;
+
+  switch (header [0])
+    {
+    case FRAME_KEY: keyframe (payload, len); break;
+    case FRAME_DELTA: delta (payload, len); break;
+    default: fatal ("unknown frame");
+    }
+  return 1;
+}
+
+/* 'q' stops watching, and the arrow keys scroll a big board. */
+static void
+read_keys (void)
+{
+  int c;
+
+  nodelay (stdscr, TRUE);
+  while ((c = getch ()) != ERR)
+    switch (c)
+      {
+      case 'q': case 'Q': quit = 1; break;
+      case KEY_LEFT: scroll_view (-1, 0); break;
+      case KEY_RIGHT: scroll_view (1, 0); break;
+      case KEY_UP: scroll_view (0, -1); break;
+      case KEY_DOWN: scroll_view (0, 1); break;
+      }
+  nodelay (stdscr, FALSE);
+  if (s->board != NULL)
+    update_screen (s);
+}
+
+int
+main (int argc, char *argv [])
+{
+  struct sockaddr_un addr;
+  struct pollfd fds [2];
+  int fd;
+
+  if (argc != 2 || strlen (argv [1]) >= sizeof addr.sun_path)
+    usage ();
+
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, argv [1]);
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || connect (fd, (struct sockaddr *) &addr, sizeof addr) == -1)
+    {
+      perror (argv [1]);
+      exit (1);
+    }
+
+  init_screen ();
+  s = init_state ();
+  write_centered (height / 2, "Waiting for a game to start ...");
+  flush_screen ();
+
+  fds [0].fd = fd;
+  fds [0].events = POLLIN;
+  fds [1].fd = 0;
+  fds [1].events = POLLIN;
+  while (!quit)
+    {
+      if (poll (fds, 2, -1) == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  fatal_perror ("poll");
+	}
+      if (fds [1].revents & POLLIN)
+	read_keys ();
+      if (fds [0].revents & (POLLIN | POLLHUP) && !read_frame (fd))
+	break;
+    }
+
+  free_screen ();
+  free_state (s);
+  close (fd);
+  exit (0);
+}